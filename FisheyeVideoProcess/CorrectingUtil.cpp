@@ -1,4 +1,552 @@
 #include "CorrectingUtil.h"
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define CORRECTING_SSE2
+#endif
+
+bool ReMapping::load(const CorrectingParams &cParams) {
+	if (isMapped()) return true;
+#ifdef TRY_CATCH
+	try {
+#endif
+		Ptr<MappedFile> file = new MappedFile();
+		if (!file->open(getPersistFilename(cParams.hashcode()))) {
+			LOG_WARN("Load ReMapping cannot be found.");
+			return false;
+		}
+		if (file->size() < REMAP_FILE_HEADER_SIZE) {
+			LOG_WARN("Load ReMapping data corrupted (truncated header).");
+			return false;
+		}
+		ReMappingFileHeader header;
+		memcpy(&header, file->data(), sizeof(ReMappingFileHeader));
+		if (!ReMappingFileHeader(cParams, Size(header.cols, header.rows)).isCompatible(header)) {
+			LOG_WARN("Load ReMapping data mismatched (version or params).");
+			return false;
+		}
+		if (file->size() < (size_t)(header.headerSize + header.payloadSize)) {
+			LOG_WARN("Load ReMapping data corrupted (truncated payload).");
+			return false;
+		}
+
+		const uchar *p = file->data() + header.headerSize;
+		Size sz(header.cols, header.rows);
+		size_t n = sz.area();
+		ReMappingChecksum checksum;
+		checksum.update(p, (size_t)header.payloadSize);
+		if (checksum.value() != header.checksum) {
+			LOG_WARN("Load ReMapping data corrupted (checksum).");
+			return false;
+		}
+
+		// Wrap the mapped pages directly, nothing is copied
+		mapX = Mat(sz, CV_32FC1, (void *)p);
+		mapY = Mat(sz, CV_32FC1, (void *)(p + n*4));
+		fixedXY = Mat(sz, CV_16SC2, (void *)(p + n*8));
+		if (header.interType == CORRECT_INTER_BILINEAR)
+			fixedWeight = Mat(sz, CV_16UC1, (void *)(p + n*12));
+		else
+			fixedWeight.release();
+		interType = (CorrectingInterType)header.interType;
+		mappedFile = file;
+		if (!hasEntries()) {
+			LOG_WARN("Load ReMapping data has no entry set, ignored.");
+			clear();
+			return false;
+		}
+		bMapped = true;
+		LOG_MESS("Successfully Load ReMapping data.");
+		return true;
+#ifdef TRY_CATCH
+	} catch(...) {
+		LOG_ERR("Load ReMapping data UNKNOWN error.");
+		clear();
+		return false;
+	}
+#endif
+}
+
+void ReMapping::persist(const CorrectingParams &cParams) {
+	if (!isMapped()) {
+		LOG_WARN("Persist ReMapping refused, no entry is set.");
+		return;
+	}
+	finalize(cParams.interType);
+#ifdef TRY_CATCH
+	try {
+#endif
+		std::string fname = getPersistFilename(cParams.hashcode());
+		std::string tmpname = fname + "." + runtimeHashCode;	// other processes may map fname meanwhile
+		FILE *fpDst;
+		if ((fpDst = fopen(tmpname.c_str(), "wb+")) == NULL) {
+			LOG_WARN("Persist ReMapping cannot be found.");
+			return;
+		}
+		assert(mapX.isContinuous() && mapY.isContinuous() && fixedXY.isContinuous());
+		ReMappingFileHeader header(cParams, mapX.size());
+		size_t n = mapX.total();
+		ReMappingChecksum checksum;
+		checksum.update(mapX.data, n*4);
+		checksum.update(mapY.data, n*4);
+		checksum.update(fixedXY.data, n*4);
+		if (interType == CORRECT_INTER_BILINEAR) checksum.update(fixedWeight.data, n*2);
+		header.checksum = checksum.value();
+
+		char headerBuf[REMAP_FILE_HEADER_SIZE];
+		memset(headerBuf, 0, sizeof(headerBuf));
+		memcpy(headerBuf, &header, sizeof(ReMappingFileHeader));
+		bool ok = fwrite(headerBuf, 1, sizeof(headerBuf), fpDst) == sizeof(headerBuf)
+			&& fwrite(mapX.data, 4, n, fpDst) == n
+			&& fwrite(mapY.data, 4, n, fpDst) == n
+			&& fwrite(fixedXY.data, 4, n, fpDst) == n
+			&& (interType != CORRECT_INTER_BILINEAR || fwrite(fixedWeight.data, 2, n, fpDst) == n);
+		fclose(fpDst);
+		// Replaces a file load() rejected, e.g. of an older version. Fails while another process maps it
+		if (!ok || !FileUtil::replaceFile(tmpname, fname)) {
+			LOG_WARN("Persist ReMapping failed, or the file is in use.");
+			remove(tmpname.c_str());
+		}
+#ifdef TRY_CATCH
+	} catch(...) {
+		LOG_ERR("Persist ReMapping data UNKNOWN error.");
+		return;
+	}
+#endif
+}
+
+/* Distance of cell (x,y) along the Hilbert curve filling a n*n grid, n a power of 2 */
+static unsigned long long hilbertIndex(unsigned int n, unsigned int x, unsigned int y) {
+	unsigned long long d = 0;
+	for (unsigned int s = n/2; s > 0; s /= 2) {
+		unsigned int rx = (x & s) > 0;
+		unsigned int ry = (y & s) > 0;
+		d += (unsigned long long)s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = n-1 - x;
+				y = n-1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+void ReMapping::buildTileOrder() {
+	tileOrder.clear();
+	std::vector<std::pair<unsigned long long, Rect> > keyed;
+	const unsigned int gridN = 1<<16;
+	for (int ty=0; ty<mapX.rows; ty+=REMAP_TILE_SIZE) {
+		for (int tx=0; tx<mapX.cols; tx+=REMAP_TILE_SIZE) {
+			Rect tile(tx, ty, min(REMAP_TILE_SIZE, mapX.cols-tx), min(REMAP_TILE_SIZE, mapX.rows-ty));
+			double sumX = 0, sumY = 0;
+			int n = 0;
+			for (int j=tile.y; j<tile.y+tile.height; ++j) {
+				const float *px = mapX.ptr<float>(j), *py = mapY.ptr<float>(j);
+				for (int i=tile.x; i<tile.x+tile.width; ++i) {
+					if (px[i] == -1 && py[i] == -1) continue;
+					sumX += px[i], sumY += py[i], ++n;
+				}
+			}
+			// Nothing to gather, reMap() only fills it
+			if (n == 0) continue;
+			unsigned int cx = (unsigned int)max(0.0, sumX/n/REMAP_TILE_SIZE);
+			unsigned int cy = (unsigned int)max(0.0, sumY/n/REMAP_TILE_SIZE);
+			keyed.push_back(std::make_pair(hilbertIndex(gridN, min(cx, gridN-1), min(cy, gridN-1)), tile));
+		}
+	}
+	std::stable_sort(keyed.begin(), keyed.end(),
+		[](const std::pair<unsigned long long, Rect> &a, const std::pair<unsigned long long, Rect> &b) {
+			return a.first < b.first;
+		});
+	tileOrder.reserve(keyed.size());
+	for (auto &k:keyed) tileOrder.push_back(k.second);
+}
+
+/* Whole-pixel part of a shift in 1/INTER_TAB_SIZE pixel, as used by the nearest gather */
+static inline Point nearestShift(Point shift) {
+	return Point(cvFloor((shift.x + INTER_TAB_SIZE/2)*1.0/INTER_TAB_SIZE),
+		cvFloor((shift.y + INTER_TAB_SIZE/2)*1.0/INTER_TAB_SIZE));
+}
+
+void ReMapping::buildSpans(Size srcSz, Point shift) {
+	spans.clear();
+	rowSpans.assign(fixedXY.rows+1, 0);
+	// Same validity as cv::remap with BORDER_TRANSPARENT: every sampled neighbour lies inside src
+	bool bilinear = interType == CORRECT_INTER_BILINEAR;
+	int ext = bilinear ? 1 : 0;
+	int xLimit = srcSz.width - ext, yLimit = srcSz.height - ext;
+	Point pixShift = nearestShift(shift);
+	for (int j=0; j<fixedXY.rows; ++j) {
+		const short *xy = fixedXY.ptr<short>(j);
+		const ushort *w = bilinear ? fixedWeight.ptr<ushort>(j) : 0;
+		const float *px = mapX.ptr<float>(j), *py = mapY.ptr<float>(j);
+		int begin = -1;
+		for (int i=0; i<=fixedXY.cols; ++i) {
+			bool valid = false;
+			// Unmapped entries must stay so once shifted
+			if (i < fixedXY.cols && !(px[i] == -1 && py[i] == -1)) {
+				int x, y;
+				if (bilinear) {
+					x = cvFloor((xy[2*i]*INTER_TAB_SIZE + (w[i] & (INTER_TAB_SIZE-1)) + shift.x)*1.0/INTER_TAB_SIZE);
+					y = cvFloor((xy[2*i+1]*INTER_TAB_SIZE + (w[i] >> INTER_BITS) + shift.y)*1.0/INTER_TAB_SIZE);
+				} else {
+					x = xy[2*i] + pixShift.x;
+					y = xy[2*i+1] + pixShift.y;
+				}
+				valid = x >= 0 && x < xLimit && y >= 0 && y < yLimit;
+			}
+			if (valid && begin < 0) {
+				begin = i;
+			} else if (!valid && begin >= 0) {
+				spans.push_back(Vec2i(begin, i));
+				begin = -1;
+			}
+		}
+		rowSpans[j+1] = (int)spans.size();
+	}
+	spanSrcSize = srcSz;
+	spanShift = shift;
+}
+
+void ReMapping::useSpans(Size srcSz, Point shift) {
+	SpanSet cur;
+	cur.spans.swap(spans);
+	cur.rowSpans.swap(rowSpans);
+	cur.srcSize = spanSrcSize;
+	cur.shift = spanShift;
+	bool isFound = false;
+	for (size_t k=0; k<keptSpans.size() && !isFound; ++k) {
+		if (keptSpans[k].srcSize != srcSz || keptSpans[k].shift != shift) continue;
+		spans.swap(keptSpans[k].spans);
+		rowSpans.swap(keptSpans[k].rowSpans);
+		spanSrcSize = srcSz;
+		spanShift = shift;
+		keptSpans.erase(keptSpans.begin()+k);
+		isFound = true;
+	}
+	if (!isFound) buildSpans(srcSz, shift);
+	// The set replaced is kept too, cameras of different drifts alternate on the same table
+	if (cur.srcSize != Size()) {
+		keptSpans.insert(keptSpans.begin(), std::move(cur));
+		if (keptSpans.size() > REMAP_KEPT_SPAN_SETS) keptSpans.pop_back();
+	}
+}
+
+/* Gather dst row j over columns [x0,x1), all valid. Fixed-point as cv::remap, INTER_BITS per axis.
+   Whole-pixel shifts only move the source base, sub-pixel ones re-split every position.
+   withGain multiplies in ReMapping::gain before the final rounding */
+template <int cn, bool withGain>
+static inline void gatherRun(const ReMapping &table, const Mat &src, Mat &dst, int j, int x0, int x1) {
+	const short *xy = table.fixedXY.ptr<short>(j);
+	const ushort *g = withGain ? table.gain.ptr<ushort>(j) : 0;
+	const uchar *s0 = src.data;
+	const size_t sstep = src.step;
+	const Point shift = table.spanShift;
+	uchar *d = dst.ptr<uchar>(j);
+	if (table.fixedWeight.empty()) {
+		Point pixShift = nearestShift(shift);
+		ptrdiff_t base = pixShift.y*(ptrdiff_t)sstep + pixShift.x*cn;
+		for (int i=x0; i<x1; ++i) {
+			const uchar *s = s0 + (xy[2*i+1]*(ptrdiff_t)sstep + xy[2*i]*cn + base);
+			if (withGain) {
+				for (int c=0; c<cn; ++c)
+					d[i*cn+c] = saturate_cast<uchar>((s[c]*g[i] + (1<<(VIGNETTING_GAIN_BITS-1))) >> VIGNETTING_GAIN_BITS);
+			} else {
+				for (int c=0; c<cn; ++c) d[i*cn+c] = s[c];
+			}
+		}
+		return;
+	}
+	const ushort *w = table.fixedWeight.ptr<ushort>(j);
+	bool subPixel = ((shift.x | shift.y) & (INTER_TAB_SIZE-1)) != 0;
+	ptrdiff_t base = subPixel ? 0 : (shift.y/INTER_TAB_SIZE)*(ptrdiff_t)sstep + (shift.x/INTER_TAB_SIZE)*cn;
+	for (int i=x0; i<x1; ++i) {
+		int x = xy[2*i], y = xy[2*i+1];
+		int fx = w[i] & (INTER_TAB_SIZE-1), fy = w[i] >> INTER_BITS;
+		if (subPixel) {
+			int ix = x*INTER_TAB_SIZE + fx + shift.x, iy = y*INTER_TAB_SIZE + fy + shift.y;
+			x = ix >> INTER_BITS, y = iy >> INTER_BITS;	// non-negative, see buildSpans()
+			fx = ix & (INTER_TAB_SIZE-1), fy = iy & (INTER_TAB_SIZE-1);
+		}
+		int w00 = (INTER_TAB_SIZE-fx)*(INTER_TAB_SIZE-fy), w01 = fx*(INTER_TAB_SIZE-fy);
+		int w10 = (INTER_TAB_SIZE-fx)*fy, w11 = fx*fy;
+		const uchar *s = s0 + (y*(ptrdiff_t)sstep + x*cn + base), *s1 = s + sstep;
+		if (withGain) {
+			// At most 255<<(2*INTER_BITS) times VIGNETTING_MAX_GAIN<<VIGNETTING_GAIN_BITS, fits an int
+			for (int c=0; c<cn; ++c)
+				d[i*cn+c] = saturate_cast<uchar>(((s[c]*w00 + s[c+cn]*w01 + s1[c]*w10 + s1[c+cn]*w11)*g[i]
+					+ (1<<(2*INTER_BITS+VIGNETTING_GAIN_BITS-1))) >> (2*INTER_BITS+VIGNETTING_GAIN_BITS));
+		} else {
+			for (int c=0; c<cn; ++c)
+				d[i*cn+c] = (uchar)((s[c]*w00 + s[c+cn]*w01 + s1[c]*w10 + s1[c+cn]*w11
+					+ (1<<(2*INTER_BITS-1))) >> (2*INTER_BITS));
+		}
+	}
+}
+
+/* Gathers dst rows, or a contiguous run of ReMapping::tileOrder when tiled,
+   each worker then stays on a compact source region. Only the valid spans are visited */
+class ReMapSpanBody : public ParallelLoopBody {
+private:
+	const ReMapping &table;
+	const Mat &src;
+	Mat &dst;
+	bool tiled;
+	uchar fillValue;
+
+	template <bool withGain>
+	void gather(int j, int x0, int x1) const {
+		switch (src.channels()) {
+		case 1: gatherRun<1, withGain>(table, src, dst, j, x0, x1); break;
+		case 2: gatherRun<2, withGain>(table, src, dst, j, x0, x1); break;
+		case 3: gatherRun<3, withGain>(table, src, dst, j, x0, x1); break;
+		case 4: gatherRun<4, withGain>(table, src, dst, j, x0, x1); break;
+		default: assert(false);
+		}
+	}
+	void gather(int j, int x0, int x1) const {
+		if (table.gain.empty()) gather<false>(j, x0, x1);
+		else gather<true>(j, x0, x1);
+	}
+	/* Outside of the spans, i.e. the mask of the circle */
+	void fill(int j, int x0, int x1) const {
+		if (x1 > x0) memset(dst.ptr<uchar>(j) + x0*dst.elemSize(), fillValue, (x1-x0)*dst.elemSize());
+	}
+public:
+	ReMapSpanBody(const ReMapping &_table, const Mat &_src, Mat &_dst, bool _tiled, uchar _fillValue)
+		:table(_table),src(_src),dst(_dst),tiled(_tiled),fillValue(_fillValue){}
+	void operator()(const Range &range) const {
+		for (int k=range.start; k<range.end; ++k) {
+			if (!tiled) {
+				int x = 0;
+				for (int s=table.rowSpans[k]; s<table.rowSpans[k+1]; ++s) {
+					fill(k, x, table.spans[s][0]);
+					gather(k, table.spans[s][0], table.spans[s][1]);
+					x = table.spans[s][1];
+				}
+				fill(k, x, dst.cols);
+				continue;
+			}
+			const Rect &tile = table.tileOrder[k];
+			for (int j=tile.y; j<tile.y+tile.height; ++j) {
+				for (int s=table.rowSpans[j]; s<table.rowSpans[j+1]; ++s) {
+					int x0 = max(table.spans[s][0], tile.x), x1 = min(table.spans[s][1], tile.x+tile.width);
+					if (x0 < x1) gather(j, x0, x1);
+				}
+			}
+		}
+	}
+};
+
+/* Blackens dst rows outside of ReMapping::spans, before a tiled gather */
+class ReMapFillBody : public ParallelLoopBody {
+private:
+	const ReMapping &table;
+	Mat &dst;
+	uchar fillValue;
+public:
+	ReMapFillBody(const ReMapping &_table, Mat &_dst, uchar _fillValue):table(_table),dst(_dst),fillValue(_fillValue){}
+	void operator()(const Range &range) const {
+		size_t esz = dst.elemSize();
+		for (int j=range.start; j<range.end; ++j) {
+			uchar *d = dst.ptr<uchar>(j);
+			int x = 0;
+			for (int s=table.rowSpans[j]; s<table.rowSpans[j+1]; ++s) {
+				memset(d + x*esz, fillValue, (table.spans[s][0]-x)*esz);
+				x = table.spans[s][1];
+			}
+			memset(d + x*esz, fillValue, (dst.cols-x)*esz);
+		}
+	}
+};
+
+bool ReMapping::reMap(Mat &srcImage, Mat &dstImage, bool tiled, Point2d shift, uchar fillValue) {
+	if (!isMapped()) return false;
+	finalize(interType);
+	if (dstImage.size() != mapX.size() || dstImage.type() != srcImage.type())
+		dstImage.create(mapX.size(), srcImage.type());
+	if (srcImage.depth() != CV_8U || srcImage.channels() > 4) {
+		// Unmapped entries fall outside of src, BORDER_TRANSPARENT leaves them untouched. No shift here
+		remap(srcImage, dstImage, fixedXY, fixedWeight,
+			interType == CORRECT_INTER_BILINEAR ? INTER_LINEAR : INTER_NEAREST, BORDER_TRANSPARENT);
+		LOG_MESS("ReMapping used.");
+		return true;
+	}
+	Point fixedShift(cvRound(shift.x*INTER_TAB_SIZE), cvRound(shift.y*INTER_TAB_SIZE));
+	if (spanSrcSize != srcImage.size() || spanShift != fixedShift) useSpans(srcImage.size(), fixedShift);
+	if (tiled) {
+		parallel_for_(Range(0, dstImage.rows), ReMapFillBody(*this, dstImage, fillValue));
+		parallel_for_(Range(0, (int)tileOrder.size()), ReMapSpanBody(*this, srcImage, dstImage, true, fillValue));
+	} else {
+		parallel_for_(Range(0, dstImage.rows), ReMapSpanBody(*this, srcImage, dstImage, false, fillValue));
+	}
+	LOG_MESS("ReMapping used.");
+	return true;
+}
+
+Ptr<ReMapping> ReMapping::downscaled(int factor, double srcRatio) const {
+	Ptr<ReMapping> table = new ReMapping();
+	table->init(Size(mapX.cols/factor, mapX.rows/factor));
+	for (int j=0; j<table->mapX.rows; ++j) {
+		for (int i=0; i<table->mapX.cols; ++i) {
+			double sumX = 0, sumY = 0;
+			int n = 0;
+			for (int dj=0; dj<factor; ++dj) {
+				const float *px = mapX.ptr<float>(factor*j+dj) + factor*i, *py = mapY.ptr<float>(factor*j+dj) + factor*i;
+				for (int di=0; di<factor; ++di) {
+					if (px[di] == -1 && py[di] == -1) continue;
+					sumX += px[di], sumY += py[di], ++n;
+				}
+			}
+			if (n == 0) continue;
+			// Pixel centers scaled by srcRatio
+			table->set((sumY/n + 0.5)*srcRatio - 0.5, (sumX/n + 0.5)*srcRatio - 0.5, j, i);
+		}
+	}
+	table->setMapped();
+	table->finalize(interType);
+	return table;
+}
+
+void ReMapping::buildChroma() {
+	chroma = downscaled(2, 0.5);
+}
+
+ReMapping &ReMapping::getLevel(int level) {
+	assert(level >= 0 && level < REMAP_PYRAMID_LEVELS);
+	if (level == 0) return *this;
+	if ((int)pyramid.size() < level+1) pyramid.resize(level+1);
+	if (pyramid[level].empty()) pyramid[level] = downscaled(1<<level, 1.0);
+	return *pyramid[level];
+}
+
+/* Chroma planes of a 4:2:0 frame of given luma size, as headers over its data */
+static void getChromaPlanes(Mat &yuv, Size lumaSz, YUVLayout layout, std::vector<Mat> &planes) {
+	Size chromaSz(lumaSz.width/2, lumaSz.height/2);
+	uchar *p = yuv.ptr(lumaSz.height);
+	planes.clear();
+	if (layout == YUV_NV12) {
+		planes.push_back(Mat(chromaSz, CV_8UC2, p));
+	} else {
+		planes.push_back(Mat(chromaSz, CV_8UC1, p));
+		planes.push_back(Mat(chromaSz, CV_8UC1, p + chromaSz.area()));
+	}
+}
+
+bool ReMapping::reMapYUV(Mat &srcYUV, Mat &dstYUV, YUVLayout layout, bool tiled, Point2d shift) {
+	if (!isMapped()) return false;
+	finalize(interType);
+	if (chroma.empty()) buildChroma();
+	Size srcSz(srcYUV.cols, srcYUV.rows*2/3), dstSz = mapX.size();
+	CV_Assert(srcYUV.type() == CV_8UC1 && srcYUV.isContinuous()
+		&& srcSz.width%2 == 0 && srcSz.height%2 == 0 && dstSz.width%2 == 0 && dstSz.height%2 == 0);
+	dstYUV.create(dstSz.height*3/2, dstSz.width, CV_8UC1);
+
+	Mat srcY = srcYUV.rowRange(0, srcSz.height);
+	Mat dstY = dstYUV.rowRange(0, dstSz.height);
+	reMap(srcY, dstY, tiled, shift);
+	std::vector<Mat> srcC, dstC;
+	getChromaPlanes(srcYUV, srcSz, layout, srcC);
+	getChromaPlanes(dstYUV, dstSz, layout, dstC);
+	// Black outside of the circle is neutral chroma
+	for (size_t k=0; k<srcC.size(); ++k) chroma->reMap(srcC[k], dstC[k], tiled, shift*0.5, 128);
+	return true;
+}
+
+bool VignettingProfile::calibrate(const std::string &clipPath, Point2d center, double radius, int frames) {
+	VideoCapture cap(clipPath);
+	if (!cap.isOpened() || radius <= 0) {
+		LOG_ERR("Vignetting calibration cannot open " << clipPath);
+		return false;
+	}
+	// Averaging over frames takes the sensor noise out of the flat field
+	Mat frame, gray, sum;
+	int n = 0;
+	for (; n<frames && cap.read(frame); ++n) {
+		cvtColor(frame, gray, CV_BGR2GRAY);
+		if (sum.empty()) sum = Mat::zeros(gray.size(), CV_32FC1);
+		accumulate(gray, sum);
+	}
+	if (n == 0) {
+		LOG_ERR("Vignetting calibration read no frame from " << clipPath);
+		return false;
+	}
+
+	std::vector<double> level(VIGNETTING_BINS, 0), count(VIGNETTING_BINS, 0);
+	for (int y=0; y<sum.rows; ++y) {
+		const float *p = sum.ptr<float>(y);
+		for (int x=0; x<sum.cols; ++x) {
+			double r = sqrt((x-center.x)*(x-center.x) + (y-center.y)*(y-center.y)) / radius;
+			if (r > 1) continue;
+			int k = cvRound(r*(VIGNETTING_BINS-1));
+			level[k] += p[x];
+			count[k] += 1;
+		}
+	}
+	// Innermost bins hold a few pixels only, fill them and any hole from the neighbours
+	for (int k=0; k<VIGNETTING_BINS; ++k) {
+		if (count[k] > 0) level[k] /= count[k];
+		else level[k] = k > 0 ? level[k-1] : 0;
+	}
+	for (int k=VIGNETTING_BINS-2; k>=0; --k) if (count[k] == 0) level[k] = level[k+1];
+	double ref = 0;
+	const int refBins = VIGNETTING_BINS/32;
+	for (int k=0; k<refBins; ++k) ref += level[k];
+	ref /= refBins;
+
+	// Smooth over a few bins, the flat field is never perfectly uniform
+	gains.assign(VIGNETTING_BINS, 1.f);
+	const int halfWin = 2;
+	for (int k=0; k<VIGNETTING_BINS; ++k) {
+		double l = 0;
+		int m = 0;
+		for (int d=-halfWin; d<=halfWin; ++d) {
+			if (k+d < 0 || k+d >= VIGNETTING_BINS) continue;
+			l += level[k+d];
+			++m;
+		}
+		l /= m;
+		gains[k] = (float)(l > 0 ? min(max(ref/l, 1.0), VIGNETTING_MAX_GAIN) : 1.0);
+	}
+	LOG_MESS("Vignetting calibrated on " << n << " frames, gain at the edge " << gains.back());
+	return true;
+}
+
+bool VignettingProfile::load(const std::string &fname) {
+	FileStorage fs(fname, FileStorage::READ);
+	if (!fs.isOpened()) return false;
+	gains.clear();
+	fs["gains"] >> gains;
+	if (gains.size() < 2) {
+		LOG_WARN("Vignetting profile " << fname << " is corrupted.");
+		gains.clear();
+		return false;
+	}
+	return true;
+}
+
+void VignettingProfile::save(const std::string &fname) const {
+	FileStorage fs(fname, FileStorage::WRITE);
+	fs << "gains" << gains;
+}
+
+void ReMapping::buildGain(const VignettingProfile &profile, Point2d center, double radius, int id) {
+	gain.create(mapX.size(), CV_16UC1);
+	for (int j=0; j<mapX.rows; ++j) {
+		const float *mx = mapX.ptr<float>(j), *my = mapY.ptr<float>(j);
+		ushort *g = gain.ptr<ushort>(j);
+		for (int i=0; i<mapX.cols; ++i) {
+			if (mx[i] < 0) {
+				g[i] = 1<<VIGNETTING_GAIN_BITS;
+				continue;
+			}
+			double dx = mx[i]-center.x, dy = my[i]-center.y;
+			g[i] = saturate_cast<ushort>(profile.at(sqrt(dx*dx + dy*dy)/radius) * (1<<VIGNETTING_GAIN_BITS));
+		}
+	}
+	gainId = id;
+}
 
 void CorrectingUtil::basicCorrecting(Mat &srcImage, Mat &dstImage, CorrectingType ctype) {
 	assert(ctype <= BASIC_REVERSED);
@@ -19,63 +567,34 @@ void CorrectingUtil::basicCorrecting(Mat &srcImage, Mat &dstImage, CorrectingTyp
 	switch (ctype)
 	{
 	case BASIC_FORWARD:
-		for (i = 0; i < row; i++)	//б
-		{
-			for (j = 0; j < col; j++)	//б
-			{
-				u = j - u0;		//,ԭԲ
-				v = v0 - i;		//,ԭԲ
-				r = sqrt(pow(u, 2) + pow(v, 2));	//Բĵľ
-				if (r > R)		//߽
-				{
-					continue;
-				}
-				//alpha
-				if (r == 0)
-				{
-					alpha = 0;
-				}
-				else if (u > 0)
-				{
-					alpha = asin(v / r);	//atan2(v,u) or asin(v/r)ԣatan(v/u)
-				}
-				else if (u < 0)
-				{
-					alpha = M_PI - asin(v / r);
-				}
-				else if (u == 0 && v>0)
-				{
-					alpha = M_PI / 2;
-				}
-				else
-					alpha = 3 * M_PI / 2;
-
-				//theta
-				theta = r / f;
-				//ӳ䵽
-				x = f*sin(theta)*cos(alpha);
-				y = f*sin(theta)*sin(alpha);
-				z = f*cos(theta);
-				//γ
-				r_xoz = sqrt(pow(x, 2) + pow(z, 2));
-				phi = M_PI / 2 - atan(y / r_xoz);	//γ
-				if (z >= 0)
-				{
-					lambda = M_PI - acos(x / r_xoz);	//
-				}
-				i_dst = round(f*phi);	//
-				j_dst = round(f*lambda);	//
-				dstImage.at<Vec3b>(i_dst, j_dst)[0] = srcImage.at<Vec3b>(i, j)[0];
-				dstImage.at<Vec3b>(i_dst, j_dst)[1] = srcImage.at<Vec3b>(i, j)[1];
-				dstImage.at<Vec3b>(i_dst, j_dst)[2] = srcImage.at<Vec3b>(i, j)[2];
-				pixelReMapping.set(std::make_pair(i,j), std::make_pair(i_dst,j_dst));
-
-			}
-		}
+		invertForwardModel(srcImage, dstImage, [&](double i, double j, double &i_dst, double &j_dst) -> bool {
+			double u = j - u0;		//,ԭԲ
+			double v = v0 - i;		//,ԭԲ
+			double r = sqrt(u*u + v*v);	//Բĵľ
+			if (r > R)		//߽
+				return false;
+			//alpha
+			double alpha = r == 0 ? 0 : atan2(v, u);
+			//theta
+			double theta = r / f;
+			//ӳ䵽
+			double x = f*sin(theta)*cos(alpha);
+			double y = f*sin(theta)*sin(alpha);
+			double z = f*cos(theta);
+			//γ
+			double r_xoz = sqrt(x*x + z*z);
+			if (r_xoz <= 0) return false;
+			double phi = M_PI / 2 - atan(y / r_xoz);	//γ
+			double lambda = M_PI - acos(x / r_xoz);	//
+			i_dst = f*phi;	//
+			j_dst = f*lambda;	//
+			return true;
+		});
 		break;
 	case BASIC_REVERSED:
 		for (i_dst = 0; i_dst < row; i_dst++)	//б
 		{
+			Vec3b *dstRow = dstImage.ptr<Vec3b>(i_dst);
 			for (j_dst = 0; j_dst < col; j_dst++)	//б
 			{
 				//γ
@@ -116,10 +635,8 @@ void CorrectingUtil::basicCorrecting(Mat &srcImage, Mat &dstImage, CorrectingTyp
 				j = u + u0;
 
 				//ֵ
-				dstImage.at<Vec3b>(i_dst, j_dst)[0] = srcImage.at<Vec3b>(i, j)[0];
-				dstImage.at<Vec3b>(i_dst, j_dst)[1] = srcImage.at<Vec3b>(i, j)[1];
-				dstImage.at<Vec3b>(i_dst, j_dst)[2] = srcImage.at<Vec3b>(i, j)[2];
-				pixelReMapping.set(std::make_pair(i,j), std::make_pair(i_dst,j_dst));
+				dstRow[j_dst] = srcImage.ptr<Vec3b>(i)[j];
+				pixelReMapping->set(i, j, i_dst, j_dst);
 
 			}
 		}
@@ -129,48 +646,292 @@ void CorrectingUtil::basicCorrecting(Mat &srcImage, Mat &dstImage, CorrectingTyp
 	}
 }
 
+Ptr<ReMapping> ReMappingCache::find(const CorrectingParams &cParams) {
+	auto range = index.equal_range(cParams.hashcode());
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second->params == cParams) {
+			lru.splice(lru.begin(), lru, it->second);
+			return lru.front().table;
+		}
+	}
+	return Ptr<ReMapping>();
+}
+
+void ReMappingCache::insert(const CorrectingParams &cParams, const Ptr<ReMapping> &table) {
+	if (table.empty() || !table->isMapped() || !find(cParams).empty()) return;
+	lru.push_front(Entry(cParams, table));
+	index.insert(std::make_pair(cParams.hashcode(), lru.begin()));
+	evict();
+}
+
+void ReMappingCache::evict() {
+	// Re-measured, derived tables (chroma, pyramid) grow after insertion
+	curBytes = 0;
+	for (auto &e:lru) curBytes += e.table->getBytes();
+	// The most recent table always stays, whatever its size
+	while (curBytes > maxBytes && lru.size() > 1) {
+		Entry &e = lru.back();
+		auto range = index.equal_range(e.params.hashcode());
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == --lru.end()) {
+				index.erase(it);
+				break;
+			}
+		}
+		curBytes -= e.table->getBytes();
+		LOG_MESS("ReMappingCache: evict table " << std::hex << e.params.hashcode() << std::dec);
+		lru.pop_back();
+	}
+}
+
 void CorrectingUtil::doCorrect(Mat &srcImage, Mat &dstImage, CorrectingParams cParams) {
-	assert(srcImage.cols == srcImage.rows);		// Ensure to be a square
+	Size squareSize = cParams.hasSrcTransform() ? cParams.squareSize : srcImage.size();
+	assert(squareSize.width == squareSize.height);		// Ensure to be a square
 	//assert(srcImage.size() == dstImage.size());
 
+	if (canCompute(cParams, srcImage) && (applyMode == CORRECT_APPLY_COMPUTE
+		|| (applyMode == CORRECT_APPLY_AUTO && computeWins.count(cParams.hashcode()) && computeWins[cParams.hashcode()]))) {
+		computeCorrect(srcImage, dstImage, cParams);
+		return;
+	}
+
 	bool needPersistReMap = false;
-	if (cParams.use_reMap && !pixelReMapping.isMapped()) {
-		if (!pixelReMapping.load(cParams.hashcode()))
-			needPersistReMap = true;
-		else
-			_cParams = cParams;
+	if (!cParams.use_reMap) {
+		pixelReMapping = new ReMapping();		// Scratch, empty table ignores set()
+	} else {
+		pixelReMapping = reMappingCache.find(cParams);
+		if (pixelReMapping.empty()) {
+			pixelReMapping = new ReMapping();
+			if (pixelReMapping->load(cParams)) {
+				reMappingCache.insert(cParams, pixelReMapping);
+			} else {
+				pixelReMapping->init(dstImage.empty() ? squareSize : dstImage.size(), cParams.srcScale, cParams.srcOffset);
+				needPersistReMap = true;
+			}
+		}
+		if (pixelReMapping->isMapped()) {
+			pixelReMapping->finalize(cParams.interType);
+			if (isModeChooser && applyMode == CORRECT_APPLY_AUTO && canCompute(cParams, srcImage)
+				&& !computeWins.count(cParams.hashcode())) {
+				chooseApplyMode(srcImage, dstImage, cParams);
+				return;
+			}
+			applyVignetting(*pixelReMapping, cParams);
+			if (pixelReMapping->reMap(srcImage, dstImage, tiledGather, cParams.srcShift)) return;
+		}
 	}
 
-	if (cParams.use_reMap && pixelReMapping.isMapped() && cParams == _cParams) {
-		if (pixelReMapping.reMap(srcImage, dstImage)) return;
+	// The models below work on the square image, only build it for the generating pass
+	Mat squareImage = srcImage;
+	if (cParams.hasSrcTransform()) {
+		Matx23d squareToSrc(
+			cParams.srcScale.x, 0, cParams.srcOffset.x,
+			0, cParams.srcScale.y, cParams.srcOffset.y);
+		warpAffine(srcImage, squareImage, squareToSrc, squareSize, INTER_LINEAR | WARP_INVERSE_MAP);
 	}
 
 	switch (cParams.ctype) {
 	case BASIC_FORWARD:
 	case BASIC_REVERSED:
-		basicCorrecting(srcImage, dstImage, cParams.ctype);
+		basicCorrecting(squareImage, dstImage, cParams.ctype);
 		break;
 	case LONG_LAT_MAPPING_FORWARD:
 	case LONG_LAT_MAPPING_REVERSED:
-		LLMCorrecting(srcImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.ctype);
+		LLMCorrecting(squareImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.ctype);
 		break;
 	case PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_FORWARD:
 		PLLMCLMCorrentingForward(
-			srcImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.dmType);
+			squareImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.dmType);
 		break;
 	case PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_REVERSED:
 		PLLMCLMCorrentingReversed(
-			srcImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.dmType);
+			squareImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.dmType,
+			getEarthRotation(cParams.yaw, cParams.pitch, cParams.roll));
 		break;
 	case LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_FORWARD:
 	case LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_REVERSED:
-		LLMCLMUFCorrecting(srcImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.ctype, cParams.w);
+		LLMCLMUFCorrecting(squareImage, dstImage, cParams.centerOfCircle, cParams.radiusOfCircle, cParams.ctype, cParams.w);
 		break;
 	default:
 		assert(false);
 	}
-	_cParams = cParams;
-	if (needPersistReMap) pixelReMapping.persist(cParams.hashcode());
+	if (cParams.use_reMap) {
+		pixelReMapping->setMapped();
+		if (!pixelReMapping->isMapped()) {
+			LOG_ERR("Correcting: the generated table has no entry set, it is not kept.");
+			return;
+		}
+		// Re-apply the fresh table so the very first frame is sampled like the following ones
+		pixelReMapping->finalize(cParams.interType);
+		applyVignetting(*pixelReMapping, cParams);
+		reMappingCache.insert(cParams, pixelReMapping);
+		if (needPersistReMap) pixelReMapping->persist(cParams);
+		// Decided on the first frame already, e.g. the warm-up before fork()
+		if (isModeChooser && applyMode == CORRECT_APPLY_AUTO && canCompute(cParams, srcImage))
+			chooseApplyMode(srcImage, dstImage, cParams);
+		else
+			pixelReMapping->reMap(srcImage, dstImage, tiledGather, cParams.srcShift);
+	}
+}
+
+void CorrectingUtil::doCorrectYUV(Mat &srcYUV, Mat &dstYUV, CorrectingParams cParams, YUVLayout layout) {
+	assert(cParams.use_reMap);
+	Ptr<ReMapping> table = reMappingCache.find(cParams);
+	if (table.empty()) {
+		// The models are written for BGR, tables are generated (or loaded) from it once
+		Mat bgr;
+		cvtColor(srcYUV, bgr, layout == YUV_NV12 ? CV_YUV2BGR_NV12 : CV_YUV2BGR_I420);
+		table = getTable(bgr, cParams);
+	}
+	table->finalize(cParams.interType);
+	applyVignetting(*table, cParams);	// luma only, chroma is left neutral
+	table->reMapYUV(srcYUV, dstYUV, layout, tiledGather, cParams.srcShift);
+}
+
+Ptr<ReMapping> CorrectingUtil::getTable(Mat &srcImage, const CorrectingParams &cParams) {
+	Ptr<ReMapping> table = reMappingCache.find(cParams);
+	if (table.empty()) {
+		// Generated (or loaded) once through the usual path, its output is dropped.
+		// The models fill the entries of their dst, which must have the table size
+		Mat square(cParams.hasSrcTransform() ? cParams.squareSize : srcImage.size(), srcImage.type());
+		// Computing on the fly would leave no table behind, e.g. after an eviction or in a fork()
+		CorrectingApplyMode mode = applyMode;
+		applyMode = CORRECT_APPLY_TABLE;
+		doCorrect(srcImage, square, cParams);
+		applyMode = mode;
+		table = reMappingCache.find(cParams);
+		if (table.empty()) CV_Error(CV_StsError, "Correcting: no table could be generated for these params.");
+	}
+	table->finalize(cParams.interType);
+	return table;
+}
+
+void CorrectingUtil::doCorrectLevel(Mat &srcImage, Mat &dstImage, CorrectingParams cParams, int level) {
+	assert(cParams.use_reMap);
+	if (level == 0) {
+		doCorrect(srcImage, dstImage, cParams);
+		return;
+	}
+	ReMapping &table = getTable(srcImage, cParams)->getLevel(level);
+	applyVignetting(table, cParams);
+	table.reMap(srcImage, dstImage, tiledGather, cParams.srcShift);
+}
+
+Ptr<CorrectingUtil> CorrectingUtil::fork() const {
+	Ptr<CorrectingUtil> other = new CorrectingUtil();
+	other->genThreads = genThreads;
+	other->tiledGather = tiledGather;
+	other->applyMode = applyMode;
+	other->computeWins = computeWins;
+	// Timed alongside the other workers a choice would be biased, params unknown yet use the table
+	other->isModeChooser = false;
+	other->reMappingCache.setMaxBytes(reMappingCache.getMaxBytes());
+	other->vignetting = vignetting;	// never modified once set
+	other->vignettingId = vignettingId;
+	return other;
+}
+
+void CorrectingUtil::applyVignetting(ReMapping &table, const CorrectingParams &cParams) {
+	if (vignetting.empty()) {
+		if (table.gainId != 0) {
+			table.gain.release();
+			table.gainId = 0;
+		}
+		return;
+	}
+	if (table.gainId == vignettingId || !table.isMapped()) return;
+	// Table entries are src positions, the circle is in the square image
+	Point2d center(cParams.centerOfCircle.x*cParams.srcScale.x + cParams.srcOffset.x,
+		cParams.centerOfCircle.y*cParams.srcScale.y + cParams.srcOffset.y);
+	table.buildGain(*vignetting, center, cParams.radiusOfCircle*cParams.srcScale.x, vignettingId);
+}
+
+void CorrectingUtil::forEachRow(int rows, const std::function<void(int)> &rowBody) const {
+	int nThreads = genThreads > 0 ? genThreads : (int)std::thread::hardware_concurrency();
+	if (nThreads > rows) nThreads = rows;
+	if (nThreads <= 1) {
+		for (int j=0; j<rows; ++j) rowBody(j);
+		return;
+	}
+	// Rows are handed out one by one, as their cost differs a lot (e.g. outside the circle)
+	std::atomic<int> nextRow(0);
+	std::vector<std::thread> workers;
+	for (int t=0; t<nThreads; ++t) {
+		workers.push_back(std::thread([&]() {
+			for (int j = nextRow++; j < rows; j = nextRow++) rowBody(j);
+		}));
+	}
+	for (int t=0; t<nThreads; ++t) workers[t].join();
+}
+
+void CorrectingUtil::invertForwardModel(Mat &srcImage, Mat &dstImage, const ForwardModel &model) {
+	if (dstImage.empty()) dstImage.create(srcImage.size(), srcImage.type());
+	// pixelReMapping is only initialized when the table is kept, invert into a scratch one otherwise
+	ReMapping scratch;
+	bool isScratch = pixelReMapping->mapX.empty();
+	if (isScratch) scratch.init(dstImage.size());
+	ReMapping &table = isScratch ? scratch : *pixelReMapping;
+
+	// Forward positions of the src grid, NaN where not mapped
+	Mat_<Vec2d> fwd(srcImage.size());
+	forEachRow(srcImage.rows, [&](int j) {
+		for (int i=0; i<srcImage.cols; ++i) {
+			double dstRow, dstCol;
+			if (model(j, i, dstRow, dstCol)) fwd(j,i) = Vec2d(dstCol, dstRow);
+			else fwd(j,i) = Vec2d(std::numeric_limits<double>::quiet_NaN(), 0);
+		}
+	});
+
+	// Every src grid cell becomes two triangles in dst. Each dst pixel center inside one
+	// takes the src position interpolated from its vertices, which leaves no holes.
+	// Cells stretched over a large part of dst straddle a discontinuity of the model
+	// (e.g. the longitude seam) and are dropped
+	const double maxExtentX = dstImage.cols/4.0, maxExtentY = dstImage.rows/4.0;
+	const double eps = 1e-9;
+	auto rasterize = [&](const Vec2d &p0, const Vec2d &p1, const Vec2d &p2,
+		const Point2d &s0, const Point2d &s1, const Point2d &s2) {
+		double minX = min(p0[0], min(p1[0], p2[0])), maxX = max(p0[0], max(p1[0], p2[0]));
+		double minY = min(p0[1], min(p1[1], p2[1])), maxY = max(p0[1], max(p1[1], p2[1]));
+		if (maxX - minX > maxExtentX || maxY - minY > maxExtentY) return;
+		double det = (p1[0]-p0[0])*(p2[1]-p0[1]) - (p2[0]-p0[0])*(p1[1]-p0[1]);
+		if (fabs(det) < eps) return;
+		int x0 = max(0, (int)ceil(minX)), x1 = min(dstImage.cols-1, (int)floor(maxX));
+		int y0 = max(0, (int)ceil(minY)), y1 = min(dstImage.rows-1, (int)floor(maxY));
+		for (int y=y0; y<=y1; ++y) {
+			for (int x=x0; x<=x1; ++x) {
+				double l1 = ((x-p0[0])*(p2[1]-p0[1]) - (p2[0]-p0[0])*(y-p0[1])) / det;
+				double l2 = ((p1[0]-p0[0])*(y-p0[1]) - (x-p0[0])*(p1[1]-p0[1])) / det;
+				double l0 = 1 - l1 - l2;
+				if (l0 < -eps || l1 < -eps || l2 < -eps) continue;
+				table.set(l0*s0.y + l1*s1.y + l2*s2.y, l0*s0.x + l1*s1.x + l2*s2.x, y, x);
+			}
+		}
+	};
+	for (int j=0; j+1<srcImage.rows; ++j) {
+		for (int i=0; i+1<srcImage.cols; ++i) {
+			const Vec2d &a = fwd(j,i), &b = fwd(j,i+1), &c = fwd(j+1,i), &d = fwd(j+1,i+1);
+			if (cvIsNaN(a[0]) || cvIsNaN(b[0]) || cvIsNaN(c[0]) || cvIsNaN(d[0])) continue;
+			rasterize(a, b, c, Point2d(i,j), Point2d(i+1,j), Point2d(i,j+1));
+			rasterize(b, d, c, Point2d(i+1,j), Point2d(i+1,j+1), Point2d(i,j+1));
+		}
+	}
+
+	// A kept table is applied by doCorrect() to the actual src, only a scratch one is applied here
+	if (isScratch) {
+		scratch.setMapped();
+		scratch.finalize(CORRECT_INTER_BILINEAR);
+		scratch.reMap(srcImage, dstImage);
+	}
+}
+
+void CorrectingUtil::getLonTable(int cols, double lon_offset, double dx, std::vector<double> &sinLon, std::vector<double> &cosLon) {
+	sinLon.resize(cols);
+	cosLon.resize(cols);
+	for (int i=0; i<cols; ++i) {
+		double lon = lon_offset + i*dx;
+		sinLon[i] = sin(lon);
+		cosLon[i] = cos(lon);
+	}
 }
 
 // LONG_LON_MAPPING
@@ -200,64 +961,53 @@ void CorrectingUtil::LLMCorrecting(
 		left = center.x - radius; assert(left == 0);
 		top = center.y - radius; assert(top == 0);
 
-		for (int j=top; j<top+2*radius; ++j)
-			for (int i=left; i<left+2*radius; ++i) {
-				if (square(i-center.x) + square(j-center.y) > square(radius)) continue;
-
-				u_src = i, v_src = j;
-
-				/* Coord Tranform */
-				x_cart = u_src - center.x;
-				y_cart = center.y - v_src;
+		invertForwardModel(srcImage, dstImage, [&](double v_src, double u_src, double &v_dst, double &u_dst) -> bool {
+			if (square(u_src-center.x) + square(v_src-center.y) > square(radius)) return false;
 
-				theta_pol = cvFastArctan(y_cart, x_cart)*PI/180;
-				p_pol = sqrt(square(x_cart) + square(y_cart));
+			/* Coord Tranform */
+			double x_cart = u_src - center.x;
+			double y_cart = center.y - v_src;
 
-				phi_sphere = theta_pol;
-				theta_sphere = p_pol/f;		// equal-distance projection 
+			double theta_pol = atan2(y_cart, x_cart);
+			double p_pol = sqrt(square(x_cart) + square(y_cart));
 
-				x = sin(theta_sphere)*cos(phi_sphere);
-				y = sin(theta_sphere)*sin(phi_sphere);
-				z = cos(theta_sphere);
+			double phi_sphere = theta_pol;
+			double theta_sphere = p_pol/f;		// equal-distance projection 
 
-				lat = acos(y);
-				lon = cvFastArctan(z,-x)*PI/180;
+			double x = sin(theta_sphere)*cos(phi_sphere);
+			double y = sin(theta_sphere)*sin(phi_sphere);
+			double z = cos(theta_sphere);
 
-				u_dst = (lon-lon_offset)/dx;
-				v_dst = (lat-lat_offset)/dy;
-
-				if (u_dst < 0 || u_dst >= dstImage.rows || v_dst < 0 || v_dst >= dstImage.cols)
-					continue;
+			double lat = acos(y);
+			double lon = atan2(z,-x);
+			if (lon < 0) lon += 2*PI;
 
-				dstImage.at<Vec3b>(v_dst,u_dst)[0] = srcImage.at<Vec3b>(j,i)[0];
-				dstImage.at<Vec3b>(v_dst,u_dst)[1] = srcImage.at<Vec3b>(j,i)[1];
-				dstImage.at<Vec3b>(v_dst,u_dst)[2] = srcImage.at<Vec3b>(j,i)[2];
-				pixelReMapping.set(std::make_pair(j,i), std::make_pair(v_dst,u_dst));
-			}
+			u_dst = (lon-lon_offset)/dx;
+			v_dst = (lat-lat_offset)/dy;
+			return true;
+		});
 		break;
-	case LONG_LAT_MAPPING_REVERSED:
-		for (int j=0; j<dstImage.rows; ++j) {
-			lat = lat_offset + j*dy;
+	case LONG_LAT_MAPPING_REVERSED: {
+		// lat only depends on the row and lon only on the column
+		std::vector<double> sinLon, cosLon;
+		getLonTable(dstImage.cols, lon_offset, dx, sinLon, cosLon);
+
+		forEachRow(dstImage.rows, [&](int j) {
+			double lat = lat_offset + j*dy;
+			double sinLat = sin(lat), cosLat = cos(lat);
+			double x, y, z;
+			double x_cart, y_cart;
+			int u_src, v_src;
+			Vec3b *dstRow = dstImage.ptr<Vec3b>(j);
 			for (int i=0; i<dstImage.cols; ++i) {
-				lon = lon_offset + i*dx;
-
 				/* Corrd Tranform */
 				// lat-lon -->> sphere
-				x = -sin(lat)*cos(lon);
-				y = cos(lat);
-				z = sin(lat)*sin(lon);
-
-				//sphere -->> theta-phi
-				theta_sphere = acos(z);
-				phi_sphere = cvFastArctan(y,x)*PI/180;
+				x = -sinLat*cosLon[i];
+				y = cosLat;
+				z = sinLat*sinLon[i];
 
-				//theta-phi -->> fisheye polar
-				p_pol = theta_sphere*f;		// equal-distance projection 
-				theta_pol = phi_sphere;
-
-				//fisheye polar -->> x,y in cart plane
-				x_cart = p_pol*cos(theta_pol);
-				y_cart = p_pol*sin(theta_pol);
+				// sphere -->> fisheye polar -->> x,y in cart plane
+				sphereToFisheyeCart(x, y, z, f, x_cart, y_cart);
 
 				u_src = center.x + x_cart;
 				v_src = center.y - y_cart;
@@ -265,13 +1015,12 @@ void CorrectingUtil::LLMCorrecting(
 				if (u_src < 0 || u_src >= srcImage.rows || v_src < 0 || v_src >= srcImage.cols)
 					continue;
 
-				dstImage.at<Vec3b>(j,i)[0] = srcImage.at<Vec3b>(v_src,u_src)[0];
-				dstImage.at<Vec3b>(j,i)[1] = srcImage.at<Vec3b>(v_src,u_src)[1];
-				dstImage.at<Vec3b>(j,i)[2] = srcImage.at<Vec3b>(v_src,u_src)[2];
-				pixelReMapping.set(std::make_pair(v_src,u_src), std::make_pair(j,i));
+				dstRow[i] = srcImage.ptr<Vec3b>(v_src)[u_src];
+				pixelReMapping->set(center.y - y_cart, center.x + x_cart, j, i);
 			}
-		}
+		});
 		break;
+	}
 	default:
 		assert(false);
 	}
@@ -337,10 +1086,8 @@ void CorrectingUtil::PLLMCLMCorrentingForward(Mat &srcImage, Mat &dstImage, Poin
 			if (u_src < 0 || u_src >= srcImage.rows || v_src < 0 || v_src >= srcImage.cols)
 					continue;
 
-			dstImage.at<Vec3b>(j,i)[0] = srcImage.at<Vec3b>(v_src,u_src)[0];
-			dstImage.at<Vec3b>(j,i)[1] = srcImage.at<Vec3b>(v_src,u_src)[1];
-			dstImage.at<Vec3b>(j,i)[2] = srcImage.at<Vec3b>(v_src,u_src)[2];
-			pixelReMapping.set(std::make_pair(v_src,u_src), std::make_pair(j,i));
+			dstImage.ptr<Vec3b>(j)[i] = srcImage.ptr<Vec3b>(v_src)[u_src];
+			pixelReMapping->set(center.y - y_cart, center.x + x_cart, j, i);
 		}
 }
 
@@ -349,91 +1096,296 @@ double CorrectingUtil::getPhiFromV(double v) {
 	return (v>2) ? PI-asin(8/(square(l)+4)-1) : asin(8/(square(l)+4)-1);   // derived by simplification
 }
 
-void CorrectingUtil::rotateEarth(double &x, double &y, double &z) {
-	Mat curP(Point3f(x,y,z));
-	std::vector<Point3f> pts;
-
+Matx33d CorrectingUtil::getEarthRotation(double yaw, double pitch, double roll) {
 	//TOSOLVE: Why rotate the earth east-wards and south-wards
-	const double theta_left = 0;
-	const double phi_up = 0;
-	pts.push_back(Point3f(cos(theta_left),0,sin(theta_left)));
-	pts.push_back(Point3f(sin(phi_up)*sin(theta_left), cos(phi_up), -sin(phi_up)*cos(theta_left)));
-	pts.push_back(Point3f(-cos(phi_up)*sin(theta_left), sin(phi_up), cos(phi_up)*cos(theta_left)));
+	const double theta_left = yaw;
+	const double phi_up = pitch;
+	// Rows are the rotated axes, the point is multiplied by the transpose
+	Matx33d axes(
+		cos(theta_left), 0, sin(theta_left),
+		sin(phi_up)*sin(theta_left), cos(phi_up), -sin(phi_up)*cos(theta_left),
+		-cos(phi_up)*sin(theta_left), sin(phi_up), cos(phi_up)*cos(theta_left));
+	// Roll turns the view around its own optical axis first
+	Matx33d rollZ(
+		cos(roll), -sin(roll), 0,
+		sin(roll), cos(roll), 0,
+		0, 0, 1);
+	return axes.t()*rollZ;
+}
 
-	Mat tmp(Mat(pts).reshape(1).t()*curP);
-	Mat_<double> tmpIte;
-	tmp.convertTo(tmpIte, CV_64F);
+template <typename T>
+void CorrectingUtil::getViewParams(DistanceMappingType dmType, Size dstSz, double dx, Point2i center,
+	const Matx33d &rotation, ViewParams<T> &vp) {
+	vp.cx = (T)center.x, vp.cy = (T)center.y;
+	for (int k=0; k<9; ++k) vp.R[k] = (T)rotation.val[k];
+	if (dmType != LONG_LAT) return;
+	// lat only depends on the row and lon only on the column
+	double lon_offset = (PI - camFieldAngle) / 2;
+	std::vector<double> sinLon, cosLon;
+	getLonTable(dstSz.width, lon_offset, dx, sinLon, cosLon);
+	vp.sinLon.assign(sinLon.begin(), sinLon.end());
+	vp.cosLon.assign(cosLon.begin(), cosLon.end());
+	vp.sinLat.resize(dstSz.height);
+	vp.cosLat.resize(dstSz.height);
+	for (int j=0; j<dstSz.height; ++j) {
+		double lat = getPhiFromV((double)j*4.0/dstSz.height);
+		//lat = lat_offset+j*dy;
+		vp.sinLat[j] = (T)sin(lat);
+		vp.cosLat[j] = (T)cos(lat);
+	}
+}
+
+template <DistanceMappingType dmType>
+void CorrectingUtil::PLLMCLMReversedRows(Mat &srcImage, Mat &dstImage, Point2i center, double f, const ViewParams<double> &vp) {
+	forEachRow(dstImage.rows, [&](int j) {
+		double x,y,z;
+		double x_cart, y_cart;
+		int u_src, v_src;
+		Vec3b *dstRow = dstImage.ptr<Vec3b>(j);
+
+		for (int i=0; i<dstImage.cols; ++i) {
+			ViewDirection<dmType, double>::get(vp, i, j, x, y, z);
+			sphereToFisheyeCart(x, y, z, f, x_cart, y_cart);
+
+			u_src = x_cart + center.x;
+			v_src = -y_cart + center.y;
+
+			if (u_src < 0 || u_src >= srcImage.rows || v_src < 0 || v_src >= srcImage.cols)
+					continue;
 
-	x = tmpIte.at<double>(0,0);
-	y = tmpIte.at<double>(1,0);
-	z = tmpIte.at<double>(2,0);
+			dstRow[i] = srcImage.ptr<Vec3b>(v_src)[u_src];
+			pixelReMapping->set(center.y - y_cart, center.x + x_cart, j, i);
+		}
+	});
 }
 
 void CorrectingUtil::PLLMCLMCorrentingReversed(
-	Mat &srcImage, Mat &dstImage, Point2i center, int radius, DistanceMappingType dmtype) {
+	Mat &srcImage, Mat &dstImage, Point2i center, int radius, DistanceMappingType dmtype, const Matx33d &rotation) {
 	double dx = camFieldAngle / srcImage.cols; 
-	double dy = dx;
 	double f = radius/(camFieldAngle/2);	// equal-distance projection  
 
-	double lat, lon;
-	double x,y,z,r;
-	double theta_sphere, phi_sphere;
-	double p_pol, theta_pol;
-	double x_cart, y_cart;
-	
-	int u_src, v_src, u_dst, v_dst;
-	double lon_offset = (PI - camFieldAngle) / 2, lat_offset = (PI - camFieldAngle) / 2;
-	double mo;
+	ViewParams<double> vp;
+	getViewParams(dmtype, dstImage.size(), dx, center, rotation, vp);
 
+	switch (dmtype) {
+	case LONG_LAT:
+		PLLMCLMReversedRows<LONG_LAT>(srcImage, dstImage, center, f, vp);
+		break;
+	case PERSPECTIVE:
+		PLLMCLMReversedRows<PERSPECTIVE>(srcImage, dstImage, center, f, vp);
+		break;
+	default:
+		assert(false);
+	}
+}
 
-	for (int j=0; j<dstImage.rows; ++j)
-		for (int i=0; i<dstImage.cols; ++i) {
-			//std::cout << i << " " << j << std::endl;
-			switch (dmtype) {
-			case LONG_LAT:
-				lat = getPhiFromV((double)j*4.0/dstImage.rows);
-				//lon = getPhiFromV((double)i*4.0/dstImage.cols);
-				//lat = lat_offset+j*dy;
-				lon = lon_offset+i*dx;
+/* Minimax odd polynomial of atan over [0,1], max error about 1e-5 rad */
+#define ATAN_C1 0.9998660f
+#define ATAN_C3 -0.3302995f
+#define ATAN_C5 0.1801410f
+#define ATAN_C7 -0.0851330f
+#define ATAN_C9 0.0208351f
+/* Marks a dst pixel the model does not reach, far outside of any src */
+#define COMPUTE_INVALID_POS -1e6f
+
+/* atan2(y,x) for y >= 0, i.e. the angle of the unit vector off the optical axis */
+static inline float atan2Poly(float y, float x) {
+	float ax = fabs(x);
+	float a = min(y, ax) / max(max(y, ax), 1e-20f);
+	float s = a*a;
+	float r = ((((ATAN_C9*s + ATAN_C7)*s + ATAN_C5)*s + ATAN_C3)*s + ATAN_C1)*a;
+	if (y > ax) r = (float)(PI/2) - r;
+	if (x < 0) r = (float)PI - r;
+	return r;
+}
 
-				x = -sin(lat)*cos(lon);
-				y = cos(lat);
-				z = sin(lat)*sin(lon);
-				break;
+#ifdef CORRECTING_SSE2
+static inline __m128 atan2Poly(__m128 y, __m128 x) {
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 ax = _mm_andnot_ps(signMask, x);
+	__m128 a = _mm_div_ps(_mm_min_ps(y, ax), _mm_max_ps(_mm_max_ps(y, ax), _mm_set1_ps(1e-20f)));
+	__m128 s = _mm_mul_ps(a, a);
+	__m128 r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ATAN_C9), s), _mm_set1_ps(ATAN_C7));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C5));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C3));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C1));
+	r = _mm_mul_ps(r, a);
+	__m128 swap = _mm_cmpgt_ps(y, ax);
+	r = _mm_or_ps(_mm_and_ps(swap, _mm_sub_ps(_mm_set1_ps((float)(PI/2)), r)), _mm_andnot_ps(swap, r));
+	__m128 back = _mm_cmplt_ps(x, _mm_setzero_ps());
+	r = _mm_or_ps(_mm_and_ps(back, _mm_sub_ps(_mm_set1_ps((float)PI), r)), _mm_andnot_ps(back, r));
+	return r;
+}
+#endif
+
+/* Sample one dst row at the given src positions, rounded as cv::convertMaps does so that
+   the output matches the fixed-point table */
+template <int cn>
+static inline void sampleRow(const Mat &src, uchar *d, const float *sx, const float *sy, int cols, bool bilinear) {
+	const uchar *s0 = src.data;
+	const size_t sstep = src.step;
+	for (int i=0; i<cols; ++i, d+=cn) {
+		if (!bilinear) {
+			int x = cvRound(sx[i]), y = cvRound(sy[i]);
+			if ((unsigned)x >= (unsigned)src.cols || (unsigned)y >= (unsigned)src.rows) {
+				for (int c=0; c<cn; ++c) d[c] = 0;
+				continue;
+			}
+			const uchar *s = s0 + y*sstep + x*cn;
+			for (int c=0; c<cn; ++c) d[c] = s[c];
+			continue;
+		}
+		int ix = cvRound(sx[i]*INTER_TAB_SIZE), iy = cvRound(sy[i]*INTER_TAB_SIZE);
+		int x = ix >> INTER_BITS, y = iy >> INTER_BITS;
+		if ((unsigned)x >= (unsigned)(src.cols-1) || (unsigned)y >= (unsigned)(src.rows-1)) {
+			for (int c=0; c<cn; ++c) d[c] = 0;
+			continue;
+		}
+		int fx = ix & (INTER_TAB_SIZE-1), fy = iy & (INTER_TAB_SIZE-1);
+		int w00 = (INTER_TAB_SIZE-fx)*(INTER_TAB_SIZE-fy), w01 = fx*(INTER_TAB_SIZE-fy);
+		int w10 = (INTER_TAB_SIZE-fx)*fy, w11 = fx*fy;
+		const uchar *s = s0 + y*sstep + x*cn, *s1 = s + sstep;
+		for (int c=0; c<cn; ++c)
+			d[c] = (uchar)((s[c]*w00 + s[c+cn]*w01 + s1[c]*w10 + s1[c+cn]*w11
+				+ (1<<(2*INTER_BITS-1))) >> (2*INTER_BITS));
+	}
+}
 
-			case PERSPECTIVE:
-				x = i-center.x;
-				y = center.y-j;
-				z = focusLen;
-				mo = sqrt(square(x) + square(y) + square(z));
-				x /= mo;
-				y /= mo;
-				z /= mo;
-				rotateEarth(x,y,z);
+/* PLLMCLMCorrentingReversed() evaluated per dst row in float, 4 pixels at a time with SSE2,
+   and sampled right away. Pixels the model does not reach are blackened as the table does */
+template <DistanceMappingType dmType>
+class PerspectiveComputeBody : public ParallelLoopBody {
+public:
+	ViewParams<float> vp;
+	float f;
+	float squareW, squareH;
+	float scaleX, scaleY, offsetX, offsetY;
+	bool bilinear;
+	const Mat *src;
+	Mat *dst;
+
+	/* Fisheye position of the unit direction (x,y,z), in src, or COMPUTE_INVALID_POS */
+	inline void project(float x, float y, float z, float &sx, float &sy) const {
+		float rho = sqrt(x*x + y*y);
+		float p = f*atan2Poly(rho, z)/max(rho, 1e-20f);
+		float col = vp.cx + p*x, row = vp.cy - p*y;
+		// Same reach as the generators, which truncate to int
+		if (col > -1 && col < squareW && row > -1 && row < squareH) {
+			sx = col*scaleX + offsetX;
+			sy = row*scaleY + offsetY;
+		} else {
+			sx = sy = COMPUTE_INVALID_POS;
+		}
+	}
 
-				break;
-			default:
-				assert(false);
+	void computeRow(int j, float *sx, float *sy) const {
+		int i = 0;
+#ifdef CORRECTING_SSE2
+		const float cx = vp.cx, cy = vp.cy;
+		const float *R = vp.R;
+		const __m128 vf = _mm_set1_ps(f), vcx = _mm_set1_ps(cx), vcy = _mm_set1_ps(cy);
+		const __m128 vminus1 = _mm_set1_ps(-1), vW = _mm_set1_ps(squareW), vH = _mm_set1_ps(squareH);
+		const __m128 vInvalid = _mm_set1_ps(COMPUTE_INVALID_POS);
+		for (; i+4 <= dst->cols; i+=4) {
+			__m128 x, y, z;
+			if (dmType == LONG_LAT) {	// resolved at compile time
+				__m128 sLat = _mm_set1_ps(vp.sinLat[j]);
+				x = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(sLat, _mm_loadu_ps(&vp.cosLon[i])));
+				y = _mm_set1_ps(vp.cosLat[j]);
+				z = _mm_mul_ps(sLat, _mm_loadu_ps(&vp.sinLon[i]));
+			} else {
+				__m128 _x = _mm_sub_ps(_mm_setr_ps((float)i, (float)(i+1), (float)(i+2), (float)(i+3)), vcx);
+				__m128 _y = _mm_set1_ps(cy - j), _z = _mm_set1_ps((float)focusLen);
+				__m128 inv = _mm_div_ps(_mm_set1_ps(1),
+					_mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_x,_x), _mm_mul_ps(_y,_y)), _mm_mul_ps(_z,_z))));
+				_x = _mm_mul_ps(_x, inv), _y = _mm_mul_ps(_y, inv), _z = _mm_mul_ps(_z, inv);
+				x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(R[0]), _x), _mm_mul_ps(_mm_set1_ps(R[1]), _y)), _mm_mul_ps(_mm_set1_ps(R[2]), _z));
+				y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(R[3]), _x), _mm_mul_ps(_mm_set1_ps(R[4]), _y)), _mm_mul_ps(_mm_set1_ps(R[5]), _z));
+				z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(R[6]), _x), _mm_mul_ps(_mm_set1_ps(R[7]), _y)), _mm_mul_ps(_mm_set1_ps(R[8]), _z));
 			}
+			__m128 rho = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x,x), _mm_mul_ps(y,y)));
+			__m128 p = _mm_div_ps(_mm_mul_ps(vf, atan2Poly(rho, z)), _mm_max_ps(rho, _mm_set1_ps(1e-20f)));
+			__m128 col = _mm_add_ps(vcx, _mm_mul_ps(p, x)), row = _mm_sub_ps(vcy, _mm_mul_ps(p, y));
+			__m128 valid = _mm_and_ps(
+				_mm_and_ps(_mm_cmpgt_ps(col, vminus1), _mm_cmplt_ps(col, vW)),
+				_mm_and_ps(_mm_cmpgt_ps(row, vminus1), _mm_cmplt_ps(row, vH)));
+			col = _mm_add_ps(_mm_mul_ps(col, _mm_set1_ps(scaleX)), _mm_set1_ps(offsetX));
+			row = _mm_add_ps(_mm_mul_ps(row, _mm_set1_ps(scaleY)), _mm_set1_ps(offsetY));
+			_mm_storeu_ps(sx+i, _mm_or_ps(_mm_and_ps(valid, col), _mm_andnot_ps(valid, vInvalid)));
+			_mm_storeu_ps(sy+i, _mm_or_ps(_mm_and_ps(valid, row), _mm_andnot_ps(valid, vInvalid)));
+		}
+#endif
+		for (; i<dst->cols; ++i) {
+			float x, y, z;
+			ViewDirection<dmType, float>::get(vp, i, j, x, y, z);
+			project(x, y, z, sx[i], sy[i]);
+		}
+	}
 
-			theta_sphere = acos(z);
-			phi_sphere = cvFastArctan(y,x)*PI/180;
+	void operator()(const Range &range) const {
+		std::vector<float> sx(dst->cols), sy(dst->cols);
+		for (int j=range.start; j<range.end; ++j) {
+			computeRow(j, &sx[0], &sy[0]);
+			uchar *d = dst->ptr<uchar>(j);
+			switch (src->channels()) {
+			case 1: sampleRow<1>(*src, d, &sx[0], &sy[0], dst->cols, bilinear); break;
+			case 2: sampleRow<2>(*src, d, &sx[0], &sy[0], dst->cols, bilinear); break;
+			case 3: sampleRow<3>(*src, d, &sx[0], &sy[0], dst->cols, bilinear); break;
+			case 4: sampleRow<4>(*src, d, &sx[0], &sy[0], dst->cols, bilinear); break;
+			default: assert(false);
+			}
+		}
+	}
+};
 
-			p_pol = f*theta_sphere;
-			theta_pol = phi_sphere;
+bool CorrectingUtil::canCompute(const CorrectingParams &cParams, const Mat &srcImage) const {
+	// The gain map only lives in the tables
+	return cParams.ctype == PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_REVERSED
+		&& srcImage.depth() == CV_8U && srcImage.channels() <= 4 && vignetting.empty();
+}
 
-			x_cart = p_pol*cos(theta_pol);
-			y_cart = p_pol*sin(theta_pol);
+template <class Body>
+void CorrectingUtil::fillComputeBody(Body &body, Mat &srcImage, Mat &dstImage, const CorrectingParams &cParams, Size squareSize) {
+	body.f = (float)(cParams.radiusOfCircle/(camFieldAngle/2));	// equal-distance projection
+	// Separable for LONG_LAT, only the per-pixel projection is left to the row loop
+	getViewParams(cParams.dmType, dstImage.size(), camFieldAngle / squareSize.width, cParams.centerOfCircle,
+		getEarthRotation(cParams.yaw, cParams.pitch, cParams.roll), body.vp);
+	body.squareW = (float)squareSize.width;
+	body.squareH = (float)squareSize.height;
+	body.scaleX = (float)cParams.srcScale.x, body.scaleY = (float)cParams.srcScale.y;
+	body.offsetX = (float)(cParams.srcOffset.x + cParams.srcShift.x);
+	body.offsetY = (float)(cParams.srcOffset.y + cParams.srcShift.y);
+	body.bilinear = cParams.interType == CORRECT_INTER_BILINEAR;
+	body.src = &srcImage;
+	body.dst = &dstImage;
+}
 
-			u_src = x_cart + center.x;
-			v_src = -y_cart + center.y;
+void CorrectingUtil::computeCorrect(Mat &srcImage, Mat &dstImage, const CorrectingParams &cParams) {
+	Size squareSize = cParams.hasSrcTransform() ? cParams.squareSize : srcImage.size();
+	if (dstImage.empty()) dstImage.create(squareSize, srcImage.type());
+	else if (dstImage.type() != srcImage.type()) dstImage.create(dstImage.size(), srcImage.type());
 
-			if (u_src < 0 || u_src >= srcImage.rows || v_src < 0 || v_src >= srcImage.cols)
-					continue;
+	if (cParams.dmType == LONG_LAT) {
+		PerspectiveComputeBody<LONG_LAT> body;
+		fillComputeBody(body, srcImage, dstImage, cParams, squareSize);
+		parallel_for_(Range(0, dstImage.rows), body);
+	} else {
+		PerspectiveComputeBody<PERSPECTIVE> body;
+		fillComputeBody(body, srcImage, dstImage, cParams, squareSize);
+		parallel_for_(Range(0, dstImage.rows), body);
+	}
+}
 
-			dstImage.at<Vec3b>(j,i) = srcImage.at<Vec3b>(v_src,u_src);
-			pixelReMapping.set(std::make_pair(v_src,u_src), std::make_pair(j,i));
-		}
+void CorrectingUtil::chooseApplyMode(Mat &srcImage, Mat &dstImage, const CorrectingParams &cParams) {
+	pixelReMapping->reMap(srcImage, dstImage, tiledGather, cParams.srcShift);	// warm up, builds the spans
+	int64 t0 = getTickCount();
+	pixelReMapping->reMap(srcImage, dstImage, tiledGather, cParams.srcShift);
+	int64 t1 = getTickCount();
+	computeCorrect(srcImage, dstImage, cParams);
+	int64 t2 = getTickCount();
+	bool b = computeWins[cParams.hashcode()] = t2-t1 < t1-t0;
+	LOG_MESS("Correcting by " << (b ? "computing" : "table") << ", table "
+		<< (t1-t0)*1000.0/getTickFrequency() << "ms against computing " << (t2-t1)*1000.0/getTickFrequency() << "ms.");
 }
 
 void CorrectingUtil::LLMCLMUFCorrecting(Mat &src, Mat &dst, Point2i center, int radius, CorrectingType ctype,  Point2d w) {
@@ -456,104 +1408,92 @@ void CorrectingUtil::LLMCLMUFCorrecting(Mat &src, Mat &dst, Point2i center, int
 	int left, top;
 
 	switch (ctype) {
-	case LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_REVERSED:
-		for (int j=0; j<dst.rows; ++j)
+	case LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_REVERSED: {
+		// lat only depends on the row; the inverse table is built here, before fanning out
+		const UfixedPhiTable &latTable = getUfixedPhiTable(w_lat);
+
+		std::vector<double> sinLon, cosLon;
+		getLonTable(dst.cols, lon_offset, dx, sinLon, cosLon);
+
+		forEachRow(dst.rows, [&](int j) {
+			double lat = latTable.phiFromV(j*lat_max / dst.rows);
+			double sinLat = sin(lat), cosLat = cos(lat);
+			double x, y, z;
+			double x_cart, y_cart;
+			double u_src, v_src;
+			Vec3b *dstRow = dst.ptr<Vec3b>(j);
 			for (int i=0; i<dst.cols; ++i) {
-				lat = getPhiFromV_ufixed(j*lat_max / dst.rows, w_lat);
 				//lon = getPhiFromV_ufixed(i*lon_max / dst.cols, w_lon);
 				//lat = lat_offset+j*dy;
-				lon = lon_offset+i*dx;
+				x = -sinLat*cosLon[i];
+				y = cosLat;
+				z = sinLat*sinLon[i];
 
-				x = -sin(lat)*cos(lon);
-				y = cos(lat);
-				z = sin(lat)*sin(lon);
-
-				theta_sphere = acos(z);
-				phi_sphere = cvFastArctan(y,x)*PI/180;
-
-				p_pol = f*theta_sphere;
-				theta_pol = phi_sphere;
-
-				x_cart = p_pol*cos(theta_pol);
-				y_cart = p_pol*sin(theta_pol);
+				sphereToFisheyeCart(x, y, z, f, x_cart, y_cart);
 
 				u_src = x_cart + center.x;
 				v_src = -y_cart + center.y;
 
 				if (u_src < 0 || u_src >= src.rows || v_src < 0 || v_src >= src.cols)
 						continue;
-				dst.at<Vec3b>(j,i) = src.at<Vec3b>(v_src,u_src);
-				pixelReMapping.set(std::make_pair(v_src,u_src), std::make_pair(j,i));
+				dstRow[i] = src.ptr<Vec3b>((int)v_src)[(int)u_src];
+				pixelReMapping->set(center.y - y_cart, center.x + x_cart, j, i);
 			}
+		});
 		break;
+	}
 	case LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_FORWARD:
-		left = center.x - radius;
-		top = center.y - radius;
-
-		for (int j = top; j < top+2*radius; ++j)
-			for (int i = left; i < left+2*radius; ++i) {
-				if (square(i-center.x) + square(j-center.y) > square(radius))
-					continue;
-				u_src = i, v_src = j;
-				x_cart = (u_src-center.x);
-				y_cart = -(v_src-center.y);
-
-				theta_pol = cvFastArctan(y_cart, x_cart)*PI/180;
-				p_pol = sqrt(square(x_cart) + square(y_cart));
-
-				theta_sphere = p_pol*(camFieldAngle/2)/radius;
-				phi_sphere = theta_pol;
-
-				x = sin(theta_sphere)*cos(phi_sphere);
-				y = sin(theta_sphere)*sin(phi_sphere);
-				z = cos(theta_sphere);
-
-				lat = acos(y);
-				lon = cvFastArctan(z,-x)*PI/180;
-
-				v_dst = src.rows*(lat_max/2-getLFromPhi_ufixed(lat, w_lat)) / lat_max;
-				//u_dst = src.cols*(lon_max/2-getLFromPhi_ufixed(lon, w_lon)) / lon_max;
-				u_dst = (lon-lon_offset)/dx;
-				//v_dst = (lat-lat_offset)/dy;
-
-				if (u_dst < 0 || u_dst >= dst.rows || v_dst < 0 || v_dst >= dst.cols)
-						continue;
-				dst.at<Vec3b>(v_dst,u_dst) = src.at<Vec3b>(j,i);
-				pixelReMapping.set(std::make_pair(j,i), std::make_pair(v_dst,u_dst));
-			}
+		invertForwardModel(src, dst, [&](double v_src, double u_src, double &v_dst, double &u_dst) -> bool {
+			if (square(u_src-center.x) + square(v_src-center.y) > square(radius))
+				return false;
+			double x_cart = (u_src-center.x);
+			double y_cart = -(v_src-center.y);
+
+			double theta_pol = atan2(y_cart, x_cart);
+			double p_pol = sqrt(square(x_cart) + square(y_cart));
+
+			double theta_sphere = p_pol*(camFieldAngle/2)/radius;
+			double phi_sphere = theta_pol;
+
+			double x = sin(theta_sphere)*cos(phi_sphere);
+			double y = sin(theta_sphere)*sin(phi_sphere);
+			double z = cos(theta_sphere);
+
+			double lat = acos(y);
+			double lon = atan2(z,-x);
+			if (lon < 0) lon += 2*PI;
+
+			v_dst = src.rows*(lat_max/2-getLFromPhi_ufixed(lat, w_lat)) / lat_max;
+			//u_dst = src.cols*(lon_max/2-getLFromPhi_ufixed(lon, w_lon)) / lon_max;
+			u_dst = (lon-lon_offset)/dx;
+			//v_dst = (lat-lat_offset)/dy;
+			return true;
+		});
 		break;
 	default:
 		assert(false);
 	}
 }
 
+const UfixedPhiTable &CorrectingUtil::getUfixedPhiTable(double w) const {
+	auto it = ufixedPhiTables.find(w);
+	if (it != ufixedPhiTables.end()) return it->second;
+
+	UfixedPhiTable &table = ufixedPhiTables[w];
+	table.w = w;
+	table.L.resize(UFIXED_PHI_TABLE_SIZE+1);
+	for (int k=0; k<=UFIXED_PHI_TABLE_SIZE; ++k)
+		table.L[k] = getLFromPhi_ufixed(k*PI/UFIXED_PHI_TABLE_SIZE, w);
+	table.L_0 = table.L[0];
+	return table;
+}
+
 double CorrectingUtil::getPhiFromV_ufixed(double v, double w) const {
-	static const int maxIter = 200;
-	int cnt = 0;
-	static double L_0 = getLFromPhi_ufixed(0,w);
-	double left, right, mid, tmp;
-	if (v >=0 && v < L_0) {
-		left = 0, right = PI/2.0, mid = left;
-	} else {
-		left = PI/2.0, right = PI, mid = right;
-	}
-	tmp = _equation_ufixed(v, mid, w);
-	while (abs(tmp) > ERR && cnt++ < maxIter) {
-		mid = (left + right) / 2;
-		tmp = _equation_ufixed(v, mid, w);
-		if (tmp > 0) left = mid;
-		else right = mid;
-	}
-	return mid;
+	return getUfixedPhiTable(w).phiFromV(v);
 }
 
 double CorrectingUtil::getLFromPhi_ufixed(double phi, double w) const {
+	if (abs(cos(phi)) < ERR) return 0;	// limit at the equator, the formula is 0/0 there
 	double l = sin(w)*sqrt(square(cos(phi)) + square(1-sin(phi))) / sin(PI - w-atan((1-sin(phi)) / abs(cos(phi))));
 	return (phi > PI/2.0) ? -l:l;
 }
-
-double CorrectingUtil::_equation_ufixed(double l, double phi, double w) const {
-	static double L_0 = getLFromPhi_ufixed(0,w);
-	return getLFromPhi_ufixed(phi,w)-L_0+l;
-}
-
@@ -1,9 +1,16 @@
 #pragma once
 
 #include "Config.h"
+#include "OtherUtils\FileUtil.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <list>
 #include <unordered_map>
+#include <limits>
 
 enum CorrectingType {
 	/* Copy from the very first version */
@@ -28,6 +35,40 @@ enum DistanceMappingType {
 	PERSPECTIVE,
 };
 
+/* Sampling used when applying the ReMapping table */
+enum CorrectingInterType {
+	CORRECT_INTER_NEAREST,
+	CORRECT_INTER_BILINEAR,	/* Fixed-point, 16-bit coords plus interpolation-weight index */
+};
+
+/* How a correction is applied once its params are known */
+enum CorrectingApplyMode {
+	CORRECT_APPLY_AUTO,		/* Time both below on the first frame with a table, keep the faster */
+	CORRECT_APPLY_TABLE,	/* Gather through the ReMapping table */
+	CORRECT_APPLY_COMPUTE,	/* Evaluate the model per pixel in float, PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_REVERSED only */
+};
+
+/* Layout of 4:2:0 frames, both held in a single CV_8UC1 Mat of rows*3/2 (see CV_YUV2BGR_I420) */
+enum YUVLayout {
+	YUV_I420,	/* Y plane, then U and V planes of half resolution */
+	YUV_NV12,	/* Y plane, then one interleaved UV plane of half resolution */
+};
+
+/* Threads used to generate the ReMapping table, 0 means one per core */
+#define CORRECTING_GEN_THREADS 0
+/* Side of the output tiles ReMapping::reMap() gathers one at a time */
+#define REMAP_TILE_SIZE 64
+/* Levels of the ReMapping pyramid: full, 1/2 and 1/4 of the dst size */
+#define REMAP_PYRAMID_LEVELS 3
+/* Span sets of other shifts a ReMapping keeps aside, e.g. one per camera sharing the table */
+#define REMAP_KEPT_SPAN_SETS 4
+/* Memory cap of the resident ReMapping tables */
+#define REMAP_CACHE_MAX_BYTES ((size_t)512<<20)
+/* Radial bins of VignettingProfile, and the fixed-point gain of ReMapping::gain */
+#define VIGNETTING_BINS 256
+#define VIGNETTING_GAIN_BITS 8
+#define VIGNETTING_MAX_GAIN 4.0
+
 #define camFieldAngle (230*PI/180.0)
 #define focusLen 450.0 /* TOSOLVE: the value remains to be tuned */
 
@@ -38,22 +79,52 @@ struct CorrectingParams {
 	DistanceMappingType dmType;
 	Point2d w;
 	bool use_reMap;
+	CorrectingInterType interType;
+	/* Viewing direction of PERSPECTIVE mapping, in radians. yaw = theta_left, pitch = phi_up */
+	double yaw, pitch, roll;
+	/* The models work on a square image of squareSize, which the table reads out of the
+	   image actually passed in at src = square*srcScale + srcOffset. Identity by default */
+	Size squareSize;
+	Point2d srcScale, srcOffset;
+	/* Drift of the circle in src, applied to the existing table at gather time.
+	   Not part of the table identity, see operator== and hashcode() */
+	Point2d srcShift;
 	/*
-		const double theta_left = 0;
-		const double phi_up = 0;
 		const double camFieldAngle = PI;  // TOSOLVE: remains to be tuned
 	*/
 
+	bool isUfixed() const {
+		return ctype == LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_FORWARD || ctype == LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_REVERSED;
+	}
+
+	bool hasSrcTransform() const {
+		return srcScale != Point2d(1,1) || srcOffset != Point2d(0,0);
+	}
+
+	/* Let the models work on squareROI of src resized to resizedSz, without resizing or cropping src.
+	   Pixel centers are aligned the way cv::resize does */
+	void setSrcTransform(Size srcSz, Size resizedSz, Rect squareROI) {
+		squareSize = squareROI.size();
+		srcScale.x = srcSz.width*1.0/resizedSz.width;
+		srcScale.y = srcSz.height*1.0/resizedSz.height;
+		srcOffset.x = (squareROI.x + 0.5)*srcScale.x - 0.5;
+		srcOffset.y = (squareROI.y + 0.5)*srcScale.y - 0.5;
+	}
+
 	bool operator == (const CorrectingParams &obj) const {
 		return ctype == obj.ctype && centerOfCircle == obj.centerOfCircle
 			&& radiusOfCircle == obj.radiusOfCircle
 			&& dmType == obj.dmType
 			&& use_reMap == obj.use_reMap
+			&& interType == obj.interType
 			&& ((ctype != LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_FORWARD && ctype != LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_REVERSED)
-				 || w == obj.w);
+				 || w == obj.w)
+			&& (dmType != PERSPECTIVE
+				|| (yaw == obj.yaw && pitch == obj.pitch && roll == obj.roll))
+			&& squareSize == obj.squareSize && srcScale == obj.srcScale && srcOffset == obj.srcOffset;
 	}
 
-	int hashcode() {
+	int hashcode() const {
 		std::vector<int> v;
 		v.push_back(ctype);
 		v.push_back(centerOfCircle.x);
@@ -63,10 +134,24 @@ struct CorrectingParams {
 		v.push_back(ctype);
 		v.push_back(camFieldAngle*10000);
 		v.push_back(focusLen*10000);
+		v.push_back(interType);
 		if (ctype == LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_FORWARD || ctype == LONG_LAT_MAPPING_CAM_LENS_MOD_UNFIXED_REVERSED ) {
 			v.push_back((int)round(w.x*10000));
 			v.push_back((int)round(w.y*10000));
 		}
+		if (dmType == PERSPECTIVE) {
+			v.push_back((int)round(yaw*10000));
+			v.push_back((int)round(pitch*10000));
+			v.push_back((int)round(roll*10000));
+		}
+		if (hasSrcTransform()) {
+			v.push_back(squareSize.width);
+			v.push_back(squareSize.height);
+			v.push_back((int)round(srcScale.x*10000));
+			v.push_back((int)round(srcScale.y*10000));
+			v.push_back((int)round(srcOffset.x*10000));
+			v.push_back((int)round(srcOffset.y*10000));
+		}
 		int ret = 0;
 		for (auto i:v) hash_combine(ret,i);
 		return ret;
@@ -78,144 +163,498 @@ struct CorrectingParams {
 		int					_radius = 0,
 		DistanceMappingType	_dmType = LONG_LAT,
 		bool 				_use_ReMap = true,
-		Point2d				_w = Point2d(PI/2.0, PI/2.0)){
+		Point2d				_w = Point2d(PI/2.0, PI/2.0),
+		CorrectingInterType	_interType = CORRECT_INTER_NEAREST){
 			ctype = _ctype;
 			centerOfCircle = _center;
 			radiusOfCircle = _radius;
 			dmType = _dmType;
 			use_reMap = _use_ReMap;
 			w = _w;
+			interType = _interType;
+			yaw = pitch = roll = 0;
+			srcScale = Point2d(1,1);
+			srcOffset = Point2d(0,0);
+			srcShift = Point2d(0,0);
 	}
 };
 
-/* Memorization for collection mapping, avoiding repeat calculation */
-struct ReMapping{
-	bool bMapped;
-	struct pairhash {//double hash function for pair key
-public:
-	template <typename T, typename U>
-	size_t operator()(const std::pair<T, U> &rhs) const {
-		int seed = 0;
-		hash_combine(seed, rhs.first);
-		hash_combine(seed, rhs.second);
-		return seed;
+/* Lens-shading (vignetting) gain over the radius of the fisheye circle, calibrated once
+   from a flat-field clip. gains[k] applies at k/(VIGNETTING_BINS-1) of the radius */
+struct VignettingProfile {
+	std::vector<float> gains;
+
+	bool empty() const {return gains.empty();}
+	/* Gain at rNorm, the distance to the center over the radius */
+	float at(double rNorm) const {
+		if (gains.empty()) return 1.f;
+		double t = (rNorm > 0 ? rNorm : 0)*(gains.size()-1);
+		int k = (int)t;
+		if (k >= (int)gains.size()-1) return gains.back();
+		return (float)(gains[k] + (t-k)*(gains[k+1]-gains[k]));
 	}
+	/* Average up to frames frames of a flat-field clip (a uniformly lit, textureless target),
+	   then take the brightness ratio of the center to each radius. Center and radius are of the clip frames */
+	bool calibrate(const std::string &clipPath, Point2d center, double radius, int frames = 100);
+	bool load(const std::string &fname);
+	void save(const std::string &fname) const;
 };
 
+/* On-disk layout of a persisted ReMapping: this header, padded to REMAP_FILE_HEADER_SIZE,
+   followed by mapX, mapY (CV_32FC1), fixedXY (CV_16SC2) and fixedWeight (CV_16UC1, bilinear only) */
+#define REMAP_FILE_MAGIC "FVPREMAP"
+#define REMAP_FILE_VERSION 3
+#define REMAP_FILE_HEADER_SIZE 256
+struct ReMappingFileHeader {
+	char magic[8];
+	int version;
+	int headerSize;
+	/* Full CorrectingParams, including the lens constants */
+	int ctype;
+	int centerX, centerY;
+	int radius;
+	int dmType;
+	int interType;
+	double wX, wY;
+	double yaw, pitch, roll;
+	double fieldAngle;
+	double focusLength;
+	int squareW, squareH;
+	double srcScaleX, srcScaleY;
+	double srcOffsetX, srcOffsetY;
+	/* Table */
+	int rows, cols;
+	long long payloadSize;
+	unsigned int checksum;
+
+	ReMappingFileHeader() {memset(this, 0, sizeof(ReMappingFileHeader));}
+	ReMappingFileHeader(const CorrectingParams &cp, Size sz) {
+		memset(this, 0, sizeof(ReMappingFileHeader));
+		memcpy(magic, REMAP_FILE_MAGIC, sizeof(magic));
+		version = REMAP_FILE_VERSION;
+		headerSize = REMAP_FILE_HEADER_SIZE;
+		ctype = cp.ctype;
+		centerX = cp.centerOfCircle.x, centerY = cp.centerOfCircle.y;
+		radius = cp.radiusOfCircle;
+		dmType = cp.dmType;
+		interType = cp.interType;
+		if (cp.isUfixed())
+			wX = cp.w.x, wY = cp.w.y;
+		if (cp.dmType == PERSPECTIVE)
+			yaw = cp.yaw, pitch = cp.pitch, roll = cp.roll;
+		fieldAngle = camFieldAngle;
+		focusLength = focusLen;
+		squareW = cp.squareSize.width, squareH = cp.squareSize.height;
+		srcScaleX = cp.srcScale.x, srcScaleY = cp.srcScale.y;
+		srcOffsetX = cp.srcOffset.x, srcOffsetY = cp.srcOffset.y;
+		rows = sz.height, cols = sz.width;
+		payloadSize = getPayloadSize();
+	}
+
+	long long getPayloadSize() const {
+		long long n = (long long)rows*cols;
+		return n*(4+4+4) + (interType == CORRECT_INTER_BILINEAR ? n*2 : 0);
+	}
+
+	/* Whether the table was built with exactly the same params (checksum aside) */
+	bool isCompatible(const ReMappingFileHeader &obj) const {
+		return memcmp(magic, obj.magic, sizeof(magic)) == 0
+			&& version == obj.version && headerSize == obj.headerSize
+			&& ctype == obj.ctype && centerX == obj.centerX && centerY == obj.centerY
+			&& radius == obj.radius && dmType == obj.dmType && interType == obj.interType
+			&& wX == obj.wX && wY == obj.wY
+			&& yaw == obj.yaw && pitch == obj.pitch && roll == obj.roll
+			&& fieldAngle == obj.fieldAngle && focusLength == obj.focusLength
+			&& squareW == obj.squareW && squareH == obj.squareH
+			&& srcScaleX == obj.srcScaleX && srcScaleY == obj.srcScaleY
+			&& srcOffsetX == obj.srcOffsetX && srcOffsetY == obj.srcOffsetY
+			&& rows > 0 && cols > 0 && payloadSize == getPayloadSize();
+	}
+};
+
+static_assert(sizeof(ReMappingFileHeader) <= REMAP_FILE_HEADER_SIZE, "ReMappingFileHeader overflows its padding");
+
+/* Fletcher-like checksum of the ReMapping payload */
+struct ReMappingChecksum {
+	unsigned long long a, b;
+	ReMappingChecksum():a(1),b(0){}
+	void update(const void *data, size_t len) {
+		const unsigned int *w = (const unsigned int *)data;
+		size_t n = len / 4;
+		for (size_t i=0; i<n; ++i) {a += w[i]; b += a;}
+		const uchar *tail = (const uchar *)(w+n);
+		for (size_t i=0; i<len%4; ++i) {a += tail[i]; b += a;}
+	}
+	unsigned int value() const {return (unsigned int)(a ^ b ^ (b >> 32));}
+};
+
+/* Memorization for collection mapping, avoiding repeat calculation.
+   Kept as a dense dst->src table (one entry per dst pixel) and applied by cv::remap */
+struct ReMapping{
+	bool bMapped;
+	Mat mapX;	// CV_32FC1, source column of each dst pixel, -1 when unmapped
+	Mat mapY;	// CV_32FC1, source row of each dst pixel, -1 when unmapped
+
+	/* Fixed-point form actually used by reMap(), see cv::convertMaps */
+	CorrectingInterType interType;
+	Mat fixedXY;	// CV_16SC2, integer source coords
+	Mat fixedWeight;	// CV_16UC1, interpolation-weight index (empty for nearest)
+
+	/* Set when the tables above point into a persisted file, they must not be written then */
+	Ptr<MappedFile> mappedFile;
+
+	/* Applied by set(), see CorrectingParams::srcScale */
+	Point2d srcScale, srcOffset;
+
+	/* Output tiles holding any mapped entry, ordered so that consecutive tiles
+	   read neighbouring source regions. Built by finalize() */
+	std::vector<Rect> tileOrder;
+
+	/* Runs of valid entries for the src size and shift they were built for, row by row:
+	   [begin,end) columns of row j are spans[rowSpans[j]..rowSpans[j+1]). Built by reMap() */
+	std::vector<Vec2i> spans;
+	std::vector<int> rowSpans;
+	Size spanSrcSize;
+	Point spanShift;	// in 1/INTER_TAB_SIZE pixel
+	/* Spans of the other src sizes and shifts recently gathered, most recent first */
+	struct SpanSet {
+		std::vector<Vec2i> spans;
+		std::vector<int> rowSpans;
+		Size srcSize;
+		Point shift;
+	};
+	std::vector<SpanSet> keptSpans;
+
+	/* Half-resolution table for 4:2:0 chroma, derived from this one by reMapYUV() */
+	Ptr<ReMapping> chroma;
 
-	std::unordered_map<std::pair<int,int>, std::pair<int,int>, pairhash> map;
+	/* pyramid[k] gathers a dst downscaled by 2^k from the same src, derived by getLevel() */
+	std::vector<Ptr<ReMapping> > pyramid;
+
+	/* Optional vignetting gain of each entry (CV_16UC1, 1<<VIGNETTING_GAIN_BITS is 1),
+	   multiplied in by reMap(). gainId tells the profile it was built from, 0 for none */
+	Mat gain;
+	int gainId;
 
 	ReMapping(){clear();}
-	void clear() {map.clear(); bMapped = false;}
-	bool isMapped() {return bMapped && map.size() != 0;}
+	void clear() {
+		mapX.release(); mapY.release();
+		fixedXY.release(); fixedWeight.release();
+		mappedFile.release();
+		interType = CORRECT_INTER_NEAREST;
+		srcScale = Point2d(1,1);
+		srcOffset = Point2d(0,0);
+		tileOrder.clear();
+		spans.clear(); rowSpans.clear(); spanSrcSize = Size(); spanShift = Point();
+		keptSpans.clear();
+		chroma.release();
+		pyramid.clear();
+		gain.release(); gainId = 0;
+		bMapped = false;
+	}
+	bool isMapped() const {return bMapped && !mapX.empty();}
+	/* Whether any entry is set, a table generated for no dst pixel has none */
+	bool hasEntries() const {
+		if (mapX.empty()) return false;
+		double maxX;
+		minMaxLoc(mapX, NULL, &maxX);
+		return maxX >= 0;
+	}
+	/* Memory held by the tables, mapped pages included */
+	size_t getBytes() const {
+		return mapX.total()*mapX.elemSize() + mapY.total()*mapY.elemSize()
+			+ fixedXY.total()*fixedXY.elemSize() + fixedWeight.total()*fixedWeight.elemSize()
+			+ gain.total()*gain.elemSize()
+			+ (chroma.empty() ? 0 : chroma->getBytes()) + getPyramidBytes();
+	}
+	size_t getPyramidBytes() const {
+		size_t bytes = 0;
+		for (size_t k=0; k<pyramid.size(); ++k) if (!pyramid[k].empty()) bytes += pyramid[k]->getBytes();
+		return bytes;
+	}
+	/* Allocate an all-unmapped table of given dst size */
+	void init(Size dstSz, Point2d _srcScale = Point2d(1,1), Point2d _srcOffset = Point2d(0,0)) {
+		srcScale = _srcScale;
+		srcOffset = _srcOffset;
+		mapX.release(); mapY.release();
+		mappedFile.release();
+		mapX.create(dstSz, CV_32FC1);
+		mapY.create(dstSz, CV_32FC1);
+		mapX.setTo(Scalar(-1));
+		mapY.setTo(Scalar(-1));
+		fixedXY.release();
+		fixedWeight.release();
+		tileOrder.clear();
+		spans.clear(); rowSpans.clear(); spanSrcSize = Size(); spanShift = Point();
+		keptSpans.clear();
+		chroma.release();
+		pyramid.clear();
+		gain.release(); gainId = 0;
+		bMapped = false;
+	}
 	std::pair<int,int> get(std::pair<int,int> dstPos) {
-		return map[dstPos];
+		return std::make_pair(
+			(int)mapY.at<float>(dstPos.first, dstPos.second),
+			(int)mapX.at<float>(dstPos.first, dstPos.second));
 	}
-	void set(std::pair<int,int>srcPos, std::pair<int,int>dstPos) {
-		bMapped = true;
-		map[dstPos] = srcPos;
+	/* Source position is kept sub-pixel for the bilinear mode.
+	   Distinct dst entries may be set from different threads concurrently */
+	void set(double srcRow, double srcCol, int dstRow, int dstCol) {
+		if (dstRow < 0 || dstRow >= mapX.rows || dstCol < 0 || dstCol >= mapX.cols)
+			return;
+		mapY.at<float>(dstRow, dstCol) = (float)(srcRow*srcScale.y + srcOffset.y);
+		mapX.at<float>(dstRow, dstCol) = (float)(srcCol*srcScale.x + srcOffset.x);
 	}
 
-	bool reMap(Mat &srcImage, Mat &dstImage) {
-		if (!isMapped()) return false;
-		for (auto it=map.begin(); it!=map.end(); ++it) {
-			int i,j,i_dst,j_dst;
-			i_dst = (it->first).first, j_dst = (it->first).second;
-			i = (it->second).first, j = (it->second).second;
-			dstImage.at<Vec3b>(i_dst,j_dst) = srcImage.at<Vec3b>(i,j);
+	/* Mark the table complete once every generating thread is done, unless nothing was set */
+	void setMapped() {bMapped = hasEntries();}
+
+	/* Derive the fixed-point table, to be called once the float table is complete */
+	void finalize(CorrectingInterType _interType) {
+		if (!isMapped()) return;
+		if (fixedXY.empty() || interType != _interType) {
+			interType = _interType;
+			fixedXY.release(); fixedWeight.release();
+			convertMaps(mapX, mapY, fixedXY, fixedWeight, CV_16SC2, interType == CORRECT_INTER_NEAREST);
+			spanSrcSize = Size();
+			keptSpans.clear();
 		}
-		LOG_MESS("ReMapping used.");
-		return true;
+		if (tileOrder.empty()) buildTileOrder();
 	}
 
+	/* Order the REMAP_TILE_SIZE output tiles along a Hilbert curve over their source centroids */
+	void buildTileOrder();
+
+	/* Fill gain from the source position of each entry, center and radius being of the src */
+	void buildGain(const VignettingProfile &profile, Point2d center, double radius, int id);
+
+	/* Record the runs of entries whose samples, moved by shift, lie inside a src of given size */
+	void buildSpans(Size srcSz, Point shift);
+	/* Make the spans those of given src size and shift, taken from keptSpans or built */
+	void useSpans(Size srcSz, Point shift);
+
+	/* Gather tile by tile in tileOrder when tiled, else row-major over the whole table.
+	   Every sample is moved by shift (src pixels, 1/INTER_TAB_SIZE precision) instead of regenerating.
+	   Only valid spans are sampled, the rest is set to fillValue. 8-bit images only,
+	   others go through cv::remap unshifted and keep their pixels outside */
+	bool reMap(Mat &srcImage, Mat &dstImage, bool tiled = true, Point2d shift = Point2d(0,0), uchar fillValue = 0);
+
+	/* Table of a dst downscaled by factor: each block maps to the mean of its mapped source positions,
+	   which are then scaled by srcRatio about pixel centers */
+	Ptr<ReMapping> downscaled(int factor, double srcRatio) const;
+	/* Derive the chroma table, half the dst over half the src */
+	void buildChroma();
+	/* Table of pyramid level, built on first use. Level 0 is this table */
+	ReMapping &getLevel(int level);
+
+	/* Apply to a 4:2:0 frame plane by plane, luma through this table and chroma through the half one */
+	bool reMapYUV(Mat &srcYUV, Mat &dstYUV, YUVLayout layout, bool tiled = true, Point2d shift = Point2d(0,0));
+
 	inline std::string getPersistFilename(int cpHash) {
 		std::string fname = TEMP_PATH +(std::string)"REMAP";
 		char hash[20];
 		sprintf(hash, "%x", cpHash);
-		fname += (std::string) hash + ".bin";
+		fname += (std::string) hash + ".lut";
 		return fname;
 	}
 
-	bool load(int cpHash) {
-		if (isMapped()) return true;
-#ifdef TRY_CATCH
-		try {
-#endif
-			FILE *fpSrc = NULL;
-			int a,b,c,d;
-			if ((fpSrc = fopen(getPersistFilename(cpHash).c_str(), "rb")) == NULL) {
-				LOG_WARN("Load ReMapping cannot be found.");
-				return false;
-			}
-			map.clear();
-			std::pair<std::pair<int,int>, std::pair<int,int>> kv;
-			int sz;
-			fread(&sz,sizeof(int), 1, fpSrc);
-			for (int i=0; i<sz; ++i) {
-				fread(&kv,sizeof(std::pair<std::pair<int,int>, std::pair<int,int>>),1,fpSrc);
-				map[kv.first] = kv.second;
-			}
-			bMapped = true;
-			LOG_MESS("Successfully Load ReMapping data.");
-			fclose(fpSrc);
-			return true;
-#ifdef TRY_CATCH
-		} catch(...) {
-			LOG_ERR("Load ReMapping data UNKNOWN error.");
-			return false;
-		}
-#endif
-	}
-
-	void persist(int cpHash) {
-		assert(isMapped());
-#ifdef TRY_CATCH
-		try {
-#endif
-			FILE *fpDst;
-			if ((fpDst = fopen(getPersistFilename(cpHash).c_str(), "wb+")) == NULL) {
-				LOG_WARN("Persist ReMapping cannot be found.");
-				return;
-			}
-			std::pair<std::pair<int,int>, std::pair<int,int>> kv;
-			int sz = map.size();
-			fwrite(&sz,sizeof(int), 1, fpDst);
-			for (auto it=map.begin(); it!=map.end();++it) {
-				kv = std::make_pair(it->first, it->second);
-				fwrite(&kv,sizeof(std::pair<std::pair<int,int>, std::pair<int,int>>),1,fpDst);
-			}
-			fclose(fpDst);
-#ifdef TRY_CATCH
-		} catch(...) {
-			LOG_ERR("Persist ReMapping data UNKNOWN error.");
-			return;
+	/* Map the persisted table of given params, no copy is made */
+	bool load(const CorrectingParams &cParams);
+	void persist(const CorrectingParams &cParams);
+};
+
+/* Tabulated monotone inverse of CorrectingUtil::getLFromPhi_ufixed() for a given w.
+   L is decreasing over phi in [0,PI], from L_0 down to -L_0 */
+#define UFIXED_PHI_TABLE_SIZE 4096
+struct UfixedPhiTable {
+	double w;
+	double L_0;
+	std::vector<double> L;	// L[k] = getLFromPhi_ufixed(k*PI/UFIXED_PHI_TABLE_SIZE, w)
+
+	/* Solve getLFromPhi_ufixed(phi, w) == L_0 - v by interpolating the table */
+	double phiFromV(double v) const {
+		const int n = (int)L.size()-1;
+		double target = L_0 - v;
+		if (target >= L[0]) return 0;
+		if (target <= L[n]) return PI;
+		int lo = 0, hi = n;
+		while (hi - lo > 1) {
+			int mid = (lo + hi) / 2;
+			if (L[mid] >= target) lo = mid;
+			else hi = mid;
 		}
-#endif
+		double t = (L[lo] - target) / (L[lo] - L[hi]);
+		return (lo + t)*PI/n;
 	}
 };
 
+/* Terms of the unit direction seen by each dst pixel of the PLLMCLM models.
+   LONG_LAT is separable: lat terms per row, lon terms per column.
+   PERSPECTIVE looks through focusLen from (cx,cy), then turns by the row-major rotation R */
+template <typename T>
+struct ViewParams {
+	std::vector<T> sinLon, cosLon, sinLat, cosLat;
+	T cx, cy;
+	T R[9];
+};
+
+/* Direction of dst pixel (i,j), specialized per DistanceMappingType at compile time
+   so that pixel loops carry no switch */
+template <DistanceMappingType dmType, typename T> struct ViewDirection;
+
+template <typename T> struct ViewDirection<LONG_LAT, T> {
+	static inline void get(const ViewParams<T> &vp, int i, int j, T &x, T &y, T &z) {
+		x = -vp.sinLat[j]*vp.cosLon[i];
+		y = vp.cosLat[j];
+		z = vp.sinLat[j]*vp.sinLon[i];
+	}
+};
+
+template <typename T> struct ViewDirection<PERSPECTIVE, T> {
+	static inline void get(const ViewParams<T> &vp, int i, int j, T &x, T &y, T &z) {
+		T _x = i - vp.cx, _y = vp.cy - j, _z = (T)focusLen;
+		T inv = 1/sqrt(_x*_x + _y*_y + _z*_z);
+		_x *= inv, _y *= inv, _z *= inv;
+		x = vp.R[0]*_x + vp.R[1]*_y + vp.R[2]*_z;
+		y = vp.R[3]*_x + vp.R[4]*_y + vp.R[5]*_z;
+		z = vp.R[6]*_x + vp.R[7]*_y + vp.R[8]*_z;
+	}
+};
+
+/* Resident ReMapping tables keyed by CorrectingParams::hashcode(),
+   the least recently used ones are evicted once over the memory cap */
+class ReMappingCache {
+private:
+	struct Entry {
+		CorrectingParams params;
+		Ptr<ReMapping> table;
+		Entry(const CorrectingParams &p, const Ptr<ReMapping> &t):params(p),table(t){}
+	};
+	std::list<Entry> lru;	// most recently used first
+	std::unordered_multimap<int, std::list<Entry>::iterator> index;
+	size_t maxBytes;
+	size_t curBytes;
+	void evict();
+public:
+	ReMappingCache(size_t _maxBytes = REMAP_CACHE_MAX_BYTES):maxBytes(_maxBytes),curBytes(0){}
+	/* Null if no table of given params is resident */
+	Ptr<ReMapping> find(const CorrectingParams &cParams);
+	void insert(const CorrectingParams &cParams, const Ptr<ReMapping> &table);
+	void setMaxBytes(size_t bytes) {maxBytes = bytes; evict();}
+	size_t getMaxBytes() const {return maxBytes;}
+	size_t size() const {return lru.size();}
+	size_t getBytes() const {return curBytes;}
+};
+
 class CorrectingUtil {
 private:
-	ReMapping pixelReMapping;
-	CorrectingParams _cParams;
+	ReMappingCache reMappingCache;
+	Ptr<ReMapping> pixelReMapping;	// table being generated or applied
+	int genThreads;
+	bool tiledGather;
+	CorrectingApplyMode applyMode;
+	/* Outcome of CORRECT_APPLY_AUTO by CorrectingParams::hashcode(), true when computing won */
+	std::unordered_map<int, bool> computeWins;
+	/* Whether this corrector times new params itself, fork()s take the choices of their origin */
+	bool isModeChooser;
+	/* Vignetting correction, none when empty. vignettingId changes with each profile set */
+	Ptr<VignettingProfile> vignetting;
+	int vignettingId;
+	/* Bring the gain of table in line with the current profile */
+	void applyVignetting(ReMapping &table, const CorrectingParams &cParams);
+	/* Run rowBody over [0,rows) spread on genThreads threads */
+	void forEachRow(int rows, const std::function<void(int)> &rowBody) const;
+	/* Forward model: src position to dst position, false where src is not mapped.
+	   Evaluated on the whole src grid from several threads */
+	typedef std::function<bool(double srcRow, double srcCol, double &dstRow, double &dstCol)> ForwardModel;
+	/* Build the dst->src table of a forward model by inverting it over the src grid,
+	   so that forward types are gathered like the reversed ones */
+	void invertForwardModel(Mat &src, Mat &dst, const ForwardModel &model);
 	void basicCorrecting(Mat &src, Mat &dst, CorrectingType ctype);
 	void LLMCorrecting(Mat &src, Mat &dst, Point2i center, int radius, CorrectingType ctype);
 	void PLLMCLMCorrentingForward(Mat &src, Mat &dst, Point2i center, int radius, DistanceMappingType dmtype);
 	void PLLMCLMCorrentingReversed(
-		Mat &src, Mat &dst, Point2i center, int radius, DistanceMappingType dmtype);	// w = PI/2
+		Mat &src, Mat &dst, Point2i center, int radius, DistanceMappingType dmtype, const Matx33d &rotation);	// w = PI/2
 	void LLMCLMUFCorrecting(Mat &src, Mat &dst, Point2i center, int radius, CorrectingType ctype, Point2d w);	// w unfixed
 	
 	// helper function
 	double getPhiFromV(double v);	// Derived from the original formula
-	void rotateEarth(double &x, double &y, double &z);
+	/* sin/cos of the longitude of each dst column */
+	static void getLonTable(int cols, double lon_offset, double dx, std::vector<double> &sinLon, std::vector<double> &cosLon);
+	/* Unit sphere point -->> fisheye polar -->> x,y in cart plane (equal-distance projection).
+	   The polar angle is taken from (x,y) directly, so only acos() is left per pixel */
+	static inline void sphereToFisheyeCart(double x, double y, double z, double f, double &x_cart, double &y_cart) {
+		double theta_sphere = acos(z);
+		double rho = sqrt(x*x + y*y);	// = sin(theta_sphere)
+		if (rho <= 0) {
+			x_cart = y_cart = 0;
+			return;
+		}
+		double p_pol = f*theta_sphere/rho;
+		x_cart = p_pol*x;
+		y_cart = p_pol*y;
+	}
+	/* Fill vp for a dst of given size, dx being the angle of one square src pixel */
+	template <typename T>
+	void getViewParams(DistanceMappingType dmType, Size dstSz, double dx, Point2i center,
+		const Matx33d &rotation, ViewParams<T> &vp);
+	/* Row loop of PLLMCLMCorrentingReversed(), one instance per mapping */
+	template <DistanceMappingType dmType>
+	void PLLMCLMReversedRows(Mat &src, Mat &dst, Point2i center, double f, const ViewParams<double> &vp);
+	/* Rotation of the viewing direction, applied by rotateEarth() */
+	static Matx33d getEarthRotation(double yaw, double pitch, double roll);
+	static inline void rotateEarth(const Matx33d &R, double &x, double &y, double &z) {
+		double _x = x, _y = y, _z = z;
+		x = R(0,0)*_x + R(0,1)*_y + R(0,2)*_z;
+		y = R(1,0)*_x + R(1,1)*_y + R(1,2)*_z;
+		z = R(2,0)*_x + R(2,1)*_y + R(2,2)*_z;
+	}
 
 	double getPhiFromV_ufixed(double v, double w) const ;
 	double getLFromPhi_ufixed(double phi, double w) const;
-	double _equation_ufixed(double v, double phi, double w) const;
+	/* Inverse tables of getLFromPhi_ufixed(), one per w. Not thread-safe when a new w shows up */
+	mutable std::map<double, UfixedPhiTable> ufixedPhiTables;
+	const UfixedPhiTable &getUfixedPhiTable(double w) const;
+
+	/* Whether CORRECT_APPLY_COMPUTE can apply given params to given src */
+	bool canCompute(const CorrectingParams &cParams, const Mat &srcImage) const;
+	/* CORRECT_APPLY_COMPUTE, no table involved */
+	void computeCorrect(Mat &srcImage, Mat &dstImage, const CorrectingParams &cParams);
+	/* Resident table of given params, generated or loaded if needed whatever the apply mode.
+	   Throws if none can be made */
+	Ptr<ReMapping> getTable(Mat &srcImage, const CorrectingParams &cParams);
+	template <class Body>
+	void fillComputeBody(Body &body, Mat &srcImage, Mat &dstImage, const CorrectingParams &cParams, Size squareSize);
+	/* Time the table against computing on this frame and record the faster in computeWins */
+	void chooseApplyMode(Mat &srcImage, Mat &dstImage, const CorrectingParams &cParams);
 
 public:
-	CorrectingUtil(){pixelReMapping = ReMapping();}
+	CorrectingUtil(){pixelReMapping = new ReMapping(); genThreads = CORRECTING_GEN_THREADS; tiledGather = true; applyMode = CORRECT_APPLY_AUTO; isModeChooser = true; vignettingId = 0;}
 	~CorrectingUtil(){};
+	/* Set threads used by table generation, 0 means one per core */
+	void setGeneratingThreads(int n) {genThreads = n;}
+	/* Gather by cache-friendly tiles (default) or row-major */
+	void setTiledGather(bool b) {tiledGather = b;}
+	/* Table lookup, computing on the fly, or the faster of both (default) */
+	void setApplyMode(CorrectingApplyMode mode) {applyMode = mode;}
+	/* Set memory cap of the resident tables, one per distinct CorrectingParams */
+	void setCacheMaxBytes(size_t bytes) {reMappingCache.setMaxBytes(bytes);}
+	/* Correct vignetting during the table gather from now on, an empty profile turns it off.
+	   Tables then always win over computing on the fly */
+	void setVignetting(const VignettingProfile &profile) {
+		if (profile.empty()) vignetting.release();
+		else vignetting = new VignettingProfile(profile);
+		++vignettingId;
+	}
+	/* New instance of the same settings without any resident table, for use on another thread.
+	   Its tables come from the persisted files, whose mapped pages are shared. The apply modes
+	   chosen so far are copied, params it meets later are applied by table */
+	Ptr<CorrectingUtil> fork() const;
 	/* Correcting interface */
 	void doCorrect(Mat &srcImage, Mat &dstImage, CorrectingParams cParams = CorrectingParams());
+	/* Same as doCorrect() into a dst downscaled by 2^level, level < REMAP_PYRAMID_LEVELS.
+	   All levels derive from one generated table and read the same src. Requires use_reMap */
+	void doCorrectLevel(Mat &srcImage, Mat &dstImage, CorrectingParams cParams, int level);
+	/* Same as doCorrect() on a 4:2:0 frame, keeping it 4:2:0. Requires use_reMap */
+	void doCorrectYUV(Mat &srcYUV, Mat &dstYUV, CorrectingParams cParams = CorrectingParams(), YUVLayout layout = YUV_I420);
 };
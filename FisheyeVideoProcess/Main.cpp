@@ -1,5 +1,6 @@
 #include "Config.h"
 #include "Processor.h"
+#include "SegmentDriver.h"
 #include <time.h>
 
 #ifdef RUN_TEST
@@ -18,6 +19,7 @@ inline std::string getruntimeHashCode() {
 std::stringstream sslog;
 FILE *fplog;
 #endif
+std::recursive_mutex logMutex;
 
 LocalStitchingInfoGroup LSIG;
 Processor processor(&LSIG);
@@ -27,11 +29,18 @@ Processor processor(&LSIG);
 int main(int argc, char ** args) {
 	runtimeHashCode = getruntimeHashCode();
 #ifdef RUN_MAIN
+	// --drive/--worker, see SegmentDriver
+	if (argc > 1) return SegmentDriver::main(argc, args);
 	std::string oriSrc[] = {
 		RESOURCE_PATH + (std::string)"front7.mp4",
 		RESOURCE_PATH + (std::string)"back7.mp4"
 	};
 	processor.setPaths(oriSrc,sizeof(oriSrc)/sizeof(std::string),OUTPUT_PATH + (std::string)"test.avi"); //TOSOLVE: ouput must be avi format??
+	// Raw frames for an external encoder, e.g. a descriptor from _open() on a named pipe
+	//processor.addOutputSink(new Y4MSink(fd));
+	// Checkpoints with the video in parts, after a failure resume() takes over from the last one
+	//processor.setCheckpoint(OUTPUT_PATH + (std::string)"test.checkpoint.yml");
+	//if (processor.resume()) return 0;
 	processor.process(3,0);
 #elif defined(RUN_TEST)
 	TestCase tc;
@@ -1,10 +1,13 @@
 #pragma once
 #include <sstream>
+#include <mutex>
 #include "Config.h"
 #define NEED_LOG
 extern std::string runtimeHashCode;
 extern std::stringstream sslog;
 extern FILE *fplog;
+/* Serializes the LOG_* macros, process() logs from several threads */
+extern std::recursive_mutex logMutex;
 
 /* LOG to screen and files */
 
@@ -17,18 +20,22 @@ extern FILE *fplog;
 		fclose(fplog);}
 
 	#define LOG_ERR(msg)          {           \
+		std::lock_guard<std::recursive_mutex> logLock(logMutex);\
 		std::cout << "[Error] " << msg << std::endl;\
 		WRITE_LOG(msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".err"));}
 
 	#define LOG_WARN(msg)          {           \
+		std::lock_guard<std::recursive_mutex> logLock(logMutex);\
 		std::cout << "[Warning] " << msg << std::endl;\
 		WRITE_LOG(msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".warn"));}
 
 	#define LOG_MESS(msg)          {          \
+		std::lock_guard<std::recursive_mutex> logLock(logMutex);\
 		std::cout << "[Message] " << msg << std::endl;\
 		WRITE_LOG(msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".mess"));}
 
 	#define LOG_MARK(msg)         {            \
+		std::lock_guard<std::recursive_mutex> logLock(logMutex);\
 		std::cout << ">>>>> " << msg << std::endl;\
 		WRITE_LOG(">>>>> " << msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".mess"));\
 		WRITE_LOG(">>>>> " << msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".warn"));\
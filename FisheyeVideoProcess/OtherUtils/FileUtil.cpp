@@ -1,4 +1,8 @@
 #include "FileUtil.h"
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
 std::unordered_set<std::string> FileUtil::waitToDeleteBuff = std::unordered_set<std::string>();
 
 FILE_STORAGE_TYPE FileUtil::FILE_STORAGE_MAT_DEFAULT = FILE_STORAGE_TYPE::BIN;
@@ -237,3 +241,42 @@ void FileUtil::decompress(const std::string&fname) {
 	std::string cmd = std::string(FU_RAROBJ) + " x -idcdpq "+ fname+FU_COMPRESS_EXTENSION;               
 	system(cmd.c_str());
 }
+
+bool FileUtil::replaceFile(const std::string &src, const std::string &dst) {
+	return MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+bool MappedFile::open(const std::string &fname) {
+	close();
+	HANDLE hf = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hf == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fsz;
+	if (!GetFileSizeEx(hf, &fsz) || fsz.QuadPart == 0 || (unsigned long long)fsz.QuadPart > (size_t)-1) {
+		CloseHandle(hf);
+		return false;
+	}
+	HANDLE hm = CreateFileMappingA(hf, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hm == NULL) {
+		CloseHandle(hf);
+		return false;
+	}
+	const void *p = MapViewOfFile(hm, FILE_MAP_READ, 0, 0, 0);
+	if (p == NULL) {
+		CloseHandle(hm);
+		CloseHandle(hf);
+		return false;
+	}
+	hFile = hf, hMapping = hm;
+	pData = (const uchar*)p;
+	sz = (size_t)fsz.QuadPart;
+	return true;
+}
+
+void MappedFile::close() {
+	if (pData != NULL) UnmapViewOfFile(pData);
+	if (hMapping != NULL) CloseHandle((HANDLE)hMapping);
+	if (hFile != NULL) CloseHandle((HANDLE)hFile);
+	hFile = hMapping = NULL;
+	pData = NULL;
+	sz = 0;
+}
@@ -14,13 +14,31 @@ enum FILE_STORAGE_TYPE {
 	LOSSY		//
 };
 
+/* Read-only memory mapping of a whole file, pages are shared among processes */
+class MappedFile {
+private:
+	void *hFile;
+	void *hMapping;
+	const uchar *pData;
+	size_t sz;
+	MappedFile(const MappedFile &);
+	MappedFile& operator = (const MappedFile &);
+public:
+	MappedFile():hFile(NULL),hMapping(NULL),pData(NULL),sz(0){}
+	~MappedFile(){close();}
+	bool open(const std::string &fname);
+	void close();
+	bool isOpened() const {return pData != NULL;}
+	const uchar* data() const {return pData;}
+	size_t size() const {return sz;}
+};
+
 class FileUtil {
 #define FU_COMPRESS_FLAG 
 #define FU_RAROBJ ".\\rar.exe "
 #define FU_COMPRESS_EXTENSION ".cmprs "
 private:
 	static std::unordered_set<std::string> waitToDeleteBuff;
-	static bool findOrCreateDir(const char * path);
 	static bool deleteFile(const char * fn, bool delay=false);
 	static std::string getFileNameByFidx(int fidx, std::string elseInfo="",std::string extension=getExtension(NORMAL));
 	static std::string getMatNameByMatidx(int fidx, int midx);
@@ -35,11 +53,14 @@ public:
 	static FILE_STORAGE_TYPE FILE_STORAGE_MAT_DEFAULT;
 	static bool SaveMatBinary(const std::string& filename, const cv::Mat& output);
 	static bool LoadMatBinary(const std::string& filename, cv::Mat& output);
+	static bool findOrCreateDir(const char * path);
 	static bool findOrCreateAllDirsNeeded();
 	static void persistFrameMats(int fidx, std::vector<cv::Mat> &mats, FILE_STORAGE_TYPE fst=NORMAL);
 	static std::vector<cv::Mat> loadFrameMats(int fidx, int sz, FILE_STORAGE_TYPE fst=NORMAL);
 	static void deletePersistedFrameMats(int fidx, int sz, FILE_STORAGE_TYPE fst=NORMAL, bool delay=false);
 	static bool deleteAllTemp();
+	/* Moves src over dst in one step, dst is either the old or the new file whatever happens */
+	static bool replaceFile(const std::string &src, const std::string &dst);
 	static void compress(const std::string& fname);
 	static void decompress(const std::string&fname);
 };
\ No newline at end of file
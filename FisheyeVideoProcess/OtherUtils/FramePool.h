@@ -0,0 +1,58 @@
+#pragma once
+#include "..\Config.h"
+#include <vector>
+#include <mutex>
+
+/* Frame buffers shared by the stages of Processor::process(), so that steady-state processing
+   allocates nothing. A buffer is free again once every Mat taken from it is released, the pool
+   being its only owner then: nothing has to be handed back explicitly. Buffers are only added,
+   the pool settles at the number of frames in flight */
+class FramePool {
+private:
+	std::vector<Mat> buffers;
+	std::mutex mtx;
+	size_t allocations, reuses;
+	size_t reportedAllocations;
+
+	FramePool():allocations(0),reuses(0),reportedAllocations(0){}
+	static FramePool &instance() {
+		static FramePool pool;
+		return pool;
+	}
+
+public:
+	/* Buffer of given size and type, its content is undefined */
+	static Mat acquire(Size sz, int type) {
+		FramePool &pool = instance();
+		std::lock_guard<std::mutex> lock(pool.mtx);
+		for (size_t k=0; k<pool.buffers.size(); ++k) {
+			Mat &m = pool.buffers[k];
+			// Only the pool refers to it, and only the pool hands it out
+			if (m.u->refcount == 1 && m.size() == sz && m.type() == type) {
+				++pool.reuses;
+				return m;
+			}
+		}
+		++pool.allocations;
+		pool.buffers.push_back(Mat(sz, type));
+		return pool.buffers.back();
+	}
+	static Mat acquire(int rows, int cols, int type) {return acquire(Size(cols, rows), type);}
+	/* Pooled copy of src */
+	static Mat copyOf(const Mat &src) {
+		Mat m = acquire(src.size(), src.type());
+		src.copyTo(m);
+		return m;
+	}
+
+	/* Log the allocations made, in total and since the last report */
+	static void report() {
+		FramePool &pool = instance();
+		std::lock_guard<std::mutex> lock(pool.mtx);
+		size_t bytes = 0;
+		for (size_t k=0; k<pool.buffers.size(); ++k) bytes += pool.buffers[k].total()*pool.buffers[k].elemSize();
+		LOG_MESS("FramePool: " << pool.allocations << " allocations (" << pool.allocations-pool.reportedAllocations
+			<< " new), " << pool.reuses << " reuses, " << (bytes>>20) << " MB held.");
+		pool.reportedAllocations = pool.allocations;
+	}
+};
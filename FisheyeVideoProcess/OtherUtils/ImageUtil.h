@@ -1,5 +1,6 @@
 #pragma once
 #include "..\Config.h"
+#include "FramePool.h"
 class ImageUtil {
 	#define BLACK_TOLERANCE 3
 private:
@@ -110,16 +111,21 @@ public:
 
 	/* USM sharpening process */
 	static void USM(Mat &src, Mat &dst) {
-		Mat blur, tmp2; 
 		double amount=1.0;
 		int thres=0;
 		double sigma=3;
 
+		Mat blur = FramePool::acquire(src.size(), src.type());
 		GaussianBlur(src,blur,Size(),sigma, sigma);
-		Mat lowContratsMask = abs(src-blur)<thres;
-		tmp2 = src*(1+amount)+blur*(-amount);
-		src.copyTo(tmp2, lowContratsMask);
-		dst = tmp2;
+		if (thres > 0) {
+			Mat lowContratsMask = abs(src-blur)<thres;
+			Mat tmp2 = src*(1+amount)+blur*(-amount);
+			src.copyTo(tmp2, lowContratsMask);
+			dst = tmp2;
+		} else {
+			// No pixel is under a zero threshold, sharpen without temporaries (in place if dst is src)
+			addWeighted(src, 1+amount, blur, -amount, 0, dst);
+		}
 	}
 
 	/* Laplace enhancement process */
@@ -140,8 +146,10 @@ public:
 		//to calculate grayscale histogram
 		cv::Mat gray;
 		if (src.type() == CV_8UC1) gray = src;
-		else if (src.type() == CV_8UC3) cvtColor(src, gray, CV_BGR2GRAY);
-		else if (src.type() == CV_8UC4) cvtColor(src, gray, CV_BGRA2GRAY);
+		else if (src.type() == CV_8UC3 || src.type() == CV_8UC4) {
+			gray = FramePool::acquire(src.size(), CV_8UC1);
+			cvtColor(src, gray, src.type() == CV_8UC3 ? CV_BGR2GRAY : CV_BGRA2GRAY);
+		} else assert(false);
 		if (clipHistPercent == 0) {
 			// keep full available range
 			cv::minMaxLoc(gray, &minGray, &maxGray);
@@ -0,0 +1,106 @@
+#pragma once
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+/* Queue between two pipeline stages. push() blocks while it is full, which holds back
+   the producer (backpressure), pop() blocks while it is empty. Once closed, pushes are
+   refused and pops drain what is left */
+template <typename T>
+class BoundedQueue {
+private:
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+	std::mutex mtx;
+	std::condition_variable notFull, notEmpty;
+
+public:
+	BoundedQueue(size_t _capacity = 1):capacity(_capacity),closed(false){}
+	void setCapacity(size_t _capacity) {
+		std::lock_guard<std::mutex> lock(mtx);
+		capacity = _capacity;
+		notFull.notify_all();
+	}
+	bool push(const T &item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		notFull.wait(lock, [this]{return closed || items.size() < capacity;});
+		if (closed) return false;
+		items.push_back(item);
+		notEmpty.notify_one();
+		return true;
+	}
+	/* False once closed and drained */
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		notEmpty.wait(lock, [this]{return closed || !items.empty();});
+		if (items.empty()) return false;
+		item = items.front();
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+	void close() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+	/* Reopen an empty queue for another run */
+	void reset() {
+		std::lock_guard<std::mutex> lock(mtx);
+		items.clear();
+		closed = false;
+	}
+};
+
+/* Puts the results of a worker pool back in sequence order. put() blocks while seq is
+   capacity or more ahead of the next one to take, so capacity must be at least the number
+   of workers: the one holding the next seq is then never blocked */
+template <typename T>
+class ReorderBuffer {
+private:
+	std::map<int, T> items;
+	int next;
+	size_t capacity;
+	bool closed;
+	std::mutex mtx;
+	std::condition_variable cond;
+
+public:
+	ReorderBuffer(size_t _capacity = 1):next(0),capacity(_capacity),closed(false){}
+	/* Reopen for another run, seq starting from first */
+	void reset(int first, size_t _capacity) {
+		std::lock_guard<std::mutex> lock(mtx);
+		items.clear();
+		next = first;
+		capacity = _capacity;
+		closed = false;
+	}
+	bool put(int seq, const T &item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		cond.wait(lock, [&]{return closed || seq < next + (int)capacity;});
+		if (closed) return false;
+		items[seq] = item;
+		cond.notify_all();
+		return true;
+	}
+	/* Next item in sequence, false once closed without it */
+	bool take(int &seq, T &item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		cond.wait(lock, [this]{return closed || items.count(next);});
+		auto it = items.find(next);
+		if (it == items.end()) return false;
+		seq = next++;
+		item = it->second;
+		items.erase(it);
+		cond.notify_all();
+		return true;
+	}
+	void close() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		cond.notify_all();
+	}
+};
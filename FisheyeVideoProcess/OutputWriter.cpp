@@ -0,0 +1,154 @@
+#include "OutputWriter.h"
+#include "OtherUtils\FramePool.h"
+#include <io.h>
+#include <fcntl.h>
+
+const Mat &OutputFrame::get(OutputFormat format) {
+	if (format == OUTPUT_BGR) return bgr;
+	std::call_once(i420Once, [this]{
+		i420 = FramePool::acquire(bgr.rows*3/2, bgr.cols, CV_8UC1);
+		cvtColor(bgr, i420, CV_BGR2YUV_I420);
+	});
+	return i420;
+}
+
+bool VideoWriterSink::open(double _fps, Size _frameSize) {
+	fps = _fps;
+	frameSize = _frameSize;
+	vWriter = VideoWriter(path, fourcc, fps, frameSize);
+	if (!vWriter.isOpened()) {
+		LOG_ERR("VideoWriterSink: cannot open " << path << ".");
+		return false;
+	}
+	return true;
+}
+
+void ImageSequenceSink::write(int fidx, const Mat &frame) {
+	std::string dstname;
+	GET_STR(dir << fidx << ext, dstname);
+#ifdef TRY_CATCH
+	try {
+#endif
+		imwrite(dstname, frame);
+#ifdef TRY_CATCH
+	} catch (cv::Exception e) {
+		LOG_ERR("ImageSequenceSink: writing " << dstname << " failed: " << e.what());
+	}
+#endif
+}
+
+bool Y4MSink::writeAll(const void *data, size_t size) {
+	const char *p = (const char *)data;
+	while (size > 0 && !isFailed) {
+		int n = _write(fd, p, (unsigned int)min(size, (size_t)INT_MAX));
+		if (n <= 0) {
+			// Typically the reading end has gone, later frames are dropped
+			LOG_ERR("Y4MSink: writing to descriptor " << fd << " failed.");
+			isFailed = true;
+		} else {
+			p += n;
+			size -= n;
+		}
+	}
+	return !isFailed;
+}
+
+bool Y4MSink::open(double fps, Size frameSize) {
+	CV_Assert(frameSize.width%2 == 0 && frameSize.height%2 == 0);
+	_setmode(fd, _O_BINARY);	// no CRLF translation of the frames
+	// Frame rate as a ratio, 1001 based for the NTSC ones (29.97 is 30000:1001)
+	int num = cvRound(fps), den = 1;
+	if (fabs(fps - num) > 1e-3) {
+		num = cvRound(fps*1.001)*1000, den = 1001;
+		if (fabs(fps - num*1.0/den) > 1e-3) num = cvRound(fps*1000), den = 1000;
+	}
+	std::string header;
+	GET_STR("YUV4MPEG2 W" << frameSize.width << " H" << frameSize.height << " F" << num << ":" << den
+		<< " Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", header);
+	return writeAll(header.data(), header.size());
+}
+
+void Y4MSink::write(int fidx, const Mat &frame) {
+	static const char frameHeader[] = "FRAME\n";
+	CV_Assert(frame.type() == CV_8UC1 && frame.isContinuous());
+	if (writeAll(frameHeader, sizeof(frameHeader)-1)) writeAll(frame.data, frame.total());
+}
+
+void OutputWriter::addSink(const Ptr<OutputSink> &sink) {
+	assert(!isOpened);
+	(sink->isOrdered() ? orderedSinks : unorderedSinks).push_back(sink);
+}
+
+bool OutputWriter::open(double fps, Size frameSize, int poolThreadsCnt) {
+	if (isOpened) return true;
+	bool ret = true;
+	for (size_t k=0; k<orderedSinks.size(); ++k) ret &= orderedSinks[k]->open(fps, frameSize);
+	for (size_t k=0; k<unorderedSinks.size(); ++k) ret &= unorderedSinks[k]->open(fps, frameSize);
+	// Without a pool, unordered sinks simply run in order
+	if (poolThreadsCnt <= 0) {
+		orderedSinks.insert(orderedSinks.end(), unorderedSinks.begin(), unorderedSinks.end());
+		unorderedSinks.clear();
+	}
+
+	orderedQueue.reset();
+	orderedQueue.setCapacity(OUTPUT_QUEUE_DEPTH);
+	unorderedQueue.reset();
+	unorderedQueue.setCapacity(OUTPUT_QUEUE_DEPTH);
+	orderedThread = std::thread(&OutputWriter::orderedLoop, this);
+	if (!unorderedSinks.empty())
+		for (int i=0; i<poolThreadsCnt; ++i) poolThreads.push_back(std::thread(&OutputWriter::unorderedLoop, this));
+	isOpened = true;
+	return ret;
+}
+
+void OutputWriter::write(int fidx, const Mat &frame) {
+	assert(isOpened);
+	Ptr<OutputFrame> outFrame = new OutputFrame(fidx, frame);
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		pending += (orderedSinks.empty() ? 0 : 1) + (unorderedSinks.empty() ? 0 : 1);
+	}
+	if (!orderedSinks.empty()) orderedQueue.push(outFrame);
+	if (!unorderedSinks.empty()) unorderedQueue.push(outFrame);
+}
+
+void OutputWriter::finishOne() {
+	std::lock_guard<std::mutex> lock(pendingMutex);
+	if (--pending == 0) pendingDone.notify_all();
+}
+
+void OutputWriter::orderedLoop() {
+	Ptr<OutputFrame> frame;
+	while (orderedQueue.pop(frame)) {
+		for (size_t k=0; k<orderedSinks.size(); ++k)
+			orderedSinks[k]->write(frame->fidx, frame->get(orderedSinks[k]->format()));
+		finishOne();
+	}
+}
+
+void OutputWriter::unorderedLoop() {
+	Ptr<OutputFrame> frame;
+	while (unorderedQueue.pop(frame)) {
+		for (size_t k=0; k<unorderedSinks.size(); ++k)
+			unorderedSinks[k]->write(frame->fidx, frame->get(unorderedSinks[k]->format()));
+		finishOne();
+	}
+}
+
+void OutputWriter::flush() {
+	std::unique_lock<std::mutex> lock(pendingMutex);
+	pendingDone.wait(lock, [this]{return pending == 0;});
+}
+
+void OutputWriter::close() {
+	if (!isOpened) return;
+	flush();
+	orderedQueue.close();
+	unorderedQueue.close();
+	orderedThread.join();
+	for (size_t i=0; i<poolThreads.size(); ++i) poolThreads[i].join();
+	poolThreads.clear();
+	for (size_t k=0; k<orderedSinks.size(); ++k) orderedSinks[k]->close();
+	for (size_t k=0; k<unorderedSinks.size(); ++k) unorderedSinks[k]->close();
+	isOpened = false;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "Config.h"
+#include "OtherUtils\PipelineQueue.h"
+#include <thread>
+
+/* Frames waiting to be written, a full queue holds back write() */
+#define OUTPUT_QUEUE_DEPTH 8
+/* Threads running the unordered sinks (e.g. one JPEG per frame), 0 runs them in order too */
+#define OUTPUT_POOL_THREADS 2
+
+/* Pixel layouts sinks take, each is converted at most once per frame whatever the number of sinks */
+enum OutputFormat {
+	OUTPUT_BGR,		/* CV_8UC3, as stitched */
+	OUTPUT_I420,	/* CV_8UC1 of rows*3/2, see CV_BGR2YUV_I420 */
+};
+
+/* A frame on its way to the sinks, shared by the threads writing it */
+class OutputFrame {
+private:
+	Mat bgr;
+	Mat i420;
+	std::once_flag i420Once;
+public:
+	int fidx;
+	OutputFrame(int _fidx, const Mat &_bgr):bgr(_bgr),fidx(_fidx){}
+	/* Converted on first request */
+	const Mat &get(OutputFormat format);
+};
+
+/* Destination of the output frames */
+class OutputSink {
+public:
+	virtual ~OutputSink(){}
+	virtual OutputFormat format() const {return OUTPUT_BGR;}
+	/* Unordered sinks take frames in any order, from several threads at once */
+	virtual bool isOrdered() const {return true;}
+	virtual bool open(double fps, Size frameSize) = 0;
+	virtual void write(int fidx, const Mat &frame) = 0;
+	virtual void close() = 0;
+};
+
+/* Encoded video through cv::VideoWriter */
+class VideoWriterSink : public OutputSink {
+private:
+	VideoWriter vWriter;
+	std::string path;
+	int fourcc;
+	double fps;
+	Size frameSize;
+public:
+	VideoWriterSink(const std::string &_path, int _fourcc = CV_FOURCC('D', 'I', 'V', 'X')):path(_path),fourcc(_fourcc),fps(0){}
+	/* Path of the next open() */
+	void setPath(const std::string &_path) {path = _path;}
+	bool open(double _fps, Size _frameSize);
+	/* Finish the current file and go on in another one, while no frame is being written */
+	bool reopen(const std::string &_path) {close(); path = _path; return open(fps, frameSize);}
+	void write(int fidx, const Mat &frame) {vWriter << frame;}
+	void close() {vWriter.release();}
+};
+
+/* One image per frame, named <dir><fidx><ext> */
+class ImageSequenceSink : public OutputSink {
+private:
+	std::string dir;
+	std::string ext;
+public:
+	ImageSequenceSink(const std::string &_dir = OUTPUT_PATH, const std::string &_ext = ".jpg"):dir(_dir),ext(_ext){}
+	bool isOrdered() const {return false;}
+	bool open(double fps, Size frameSize) {return true;}
+	void write(int fidx, const Mat &frame);
+	void close() {}
+};
+
+/* Raw YUV4MPEG2 stream (4:2:0) to a file descriptor, e.g. a pipe into a separate encoder.
+   Nothing lossy happens before it. The descriptor is not closed by close() */
+class Y4MSink : public OutputSink {
+private:
+	int fd;
+	bool isFailed;
+	bool writeAll(const void *data, size_t size);
+public:
+	Y4MSink(int _fd):fd(_fd),isFailed(false){}
+	OutputFormat format() const {return OUTPUT_I420;}
+	bool open(double fps, Size frameSize);
+	void write(int fidx, const Mat &frame);
+	void close() {}
+};
+
+/* Writes the output in the background, so that encoding and disk latency do not stall stitching.
+   Ordered sinks are fed by one thread in frame order, unordered ones go through a pool */
+class OutputWriter {
+private:
+	std::vector<Ptr<OutputSink>> orderedSinks;
+	std::vector<Ptr<OutputSink>> unorderedSinks;
+	BoundedQueue<Ptr<OutputFrame>> orderedQueue;
+	BoundedQueue<Ptr<OutputFrame>> unorderedQueue;
+	std::thread orderedThread;
+	std::vector<std::thread> poolThreads;
+	bool isOpened;
+
+	/* Frames queued and not written yet, flush() waits for none */
+	int pending;
+	std::mutex pendingMutex;
+	std::condition_variable pendingDone;
+	void finishOne();
+
+	void orderedLoop();
+	void unorderedLoop();
+
+public:
+	OutputWriter():isOpened(false),pending(0){}
+	~OutputWriter() {close();}
+	/* Sinks are added before open(), any number of them */
+	void addSink(const Ptr<OutputSink> &sink);
+	bool open(double fps, Size frameSize, int poolThreadsCnt = OUTPUT_POOL_THREADS);
+	bool opened() const {return isOpened;}
+	/* Queue a frame, the caller must not write into it afterwards */
+	void write(int fidx, const Mat &frame);
+	/* Wait until every frame queued so far is written */
+	void flush();
+	/* Flush, then stop the threads and close the sinks */
+	void close();
+};
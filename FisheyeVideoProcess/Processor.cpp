@@ -3,6 +3,7 @@
 #include "OtherUtils\ImageUtil.h"
 #include "OtherUtils\FileUtil.h"
 #include "OtherUtils\StablizeUtil.h"
+#include "OtherUtils\FramePool.h"
 
 Processor::Processor(LocalStitchingInfoGroup *_pLSIG) {
 	FileUtil::findOrCreateAllDirsNeeded();	// create or validate necessary folders and files
@@ -10,8 +11,22 @@ Processor::Processor(LocalStitchingInfoGroup *_pLSIG) {
 	stitchingUtil = StitchingUtil();
 	pLSIG = _pLSIG;
 	curStitchingIdx = 0;
+	checkpointSeconds = checkpointFrames = 0;
+	firstPart = curPart = 0;
+	isFoundFisheyeRegion = false;
+	radiusOfCircle = 0;
+	centerOfCircleBeforeResz = centerOfCircleAfterResz = Point2i(0,0);
 	inputFisheyeResize = INPUT_FISHEYE_RESIZE;
 	dstPanoSize = OUTPUT_PANO_SIZE;
+	for (int i=0; i<CAMERA_CNT; ++i) {
+		isCircleRefSet[i] = false;
+		circleDrift[i] = Point2d(0,0);
+	}
+	VignettingProfile vignetting;
+	if (vignetting.load(VIGNETTING_PROFILE_PATH)) {
+		correctingUtil.setVignetting(vignetting);
+		LOG_MESS("Vignetting profile loaded.");
+	}
 }
 
 Processor::~Processor() {
@@ -30,11 +45,186 @@ void Processor::calculateWinSz(int fidx, int &lidx, int &ridx) {
 
 
 void Processor::findFisheyeCircleRegion(Mat &frm) {
-	// TOSOLVE: Simplest estimation,
-	// but in fact circle region may move slightly from time to time
-	radiusOfCircle = (int)round(frm.size().height/2);
-	centerOfCircleBeforeResz.y = radiusOfCircle;
-	centerOfCircleBeforeResz.x = (int)round(frm.size().width/2);
+	findFisheyeCircleRegion(frm, centerOfCircleBeforeResz, radiusOfCircle);
+}
+
+void Processor::findFisheyeCircleRegion(const Mat &frm, Point2i &center, int &radius) {
+	// Simplest estimation, the circle moving slightly from time to time
+	// is followed by trackCircleDrift()
+	radius = (int)round(frm.size().height/2);
+	center.y = radius;
+	center.x = (int)round(frm.size().width/2);
+}
+
+bool Processor::detectCircleCenter(Mat &frm, Point2d &center) {
+	Mat small, gray, mask;
+	double ratio = CIRCLE_DETECT_LENGTH*1.0/max(frm.cols, frm.rows);
+	ImageUtil::resize(frm, small, Size(cvRound(frm.cols*ratio), cvRound(frm.rows*ratio)));
+	cvtColor(small, gray, CV_BGR2GRAY);
+	threshold(gray, mask, CIRCLE_DETECT_THRESHOLD, 255, THRESH_BINARY);
+	Moments m = moments(mask, true);
+	if (m.m00 < 0.1*mask.total()) return false;	// mostly black, e.g. a fade
+	center.x = (m.m10/m.m00 + 0.5)*inputFisheyeResize.width/small.cols - 0.5;
+	center.y = (m.m01/m.m00 + 0.5)*inputFisheyeResize.height/small.rows - 0.5;
+	return true;
+}
+
+void Processor::trackCircleDrift(int camIdx, Mat &frm) {
+	Point2d center;
+	if (!detectCircleCenter(frm, center)) {
+		LOG_WARN("Circle of camera " << camIdx << " not found, drift kept.");
+		return;
+	}
+	// The first detection is the reference, its own bias cancels out
+	if (!isCircleRefSet[camIdx]) {
+		circleRefCenter[camIdx] = center;
+		isCircleRefSet[camIdx] = true;
+		return;
+	}
+	Point2d drift = center - circleRefCenter[camIdx];
+	if (norm(drift) > radiusOfCircle*CIRCLE_MAX_DRIFT_RATIO) {
+		LOG_WARN("Circle of camera " << camIdx << " drifted by " << drift << ", ignored.");
+		return;
+	}
+	if (norm(drift - circleDrift[camIdx]) < CIRCLE_MIN_DRIFT_CHANGE) return;
+	circleDrift[camIdx] = drift;
+	LOG_MESS("Circle of camera " << camIdx << " drifted by " << drift << ".");
+}
+
+bool Processor::writeCalibration(FileStorage &fs) {
+	fs << "circleRefCenter" << "[";
+	for (int i=0; i<CAMERA_CNT; ++i) fs << (isCircleRefSet[i] ? circleRefCenter[i] : Point2d(-1,-1));
+	fs << "]";
+	fs << "lsig" << "{";
+	bool ret = pLSIG->writeCalibration(fs);
+	fs << "}";
+	return ret;
+}
+
+bool Processor::readCalibration(FileStorage &fs) {
+	// Drift is then measured from the same reference in every run
+	FileNode centers = fs["circleRefCenter"];
+	int i = 0;
+	for (FileNodeIterator it=centers.begin(); it!=centers.end() && i<CAMERA_CNT; ++it, ++i) {
+		*it >> circleRefCenter[i];
+		isCircleRefSet[i] = circleRefCenter[i].x >= 0;
+	}
+	return pLSIG->readCalibration(fs["lsig"]);
+}
+
+bool Processor::saveCalibration(const std::string &path) {
+	FileStorage fs(path, FileStorage::WRITE);
+	if (!fs.isOpened()) {
+		LOG_ERR("Calibration cannot be written to " << path << ".");
+		return false;
+	}
+	bool ret = writeCalibration(fs);
+	if (!ret) LOG_WARN("No stitching calibration settled yet, only the circles are saved.");
+	return ret;
+}
+
+bool Processor::loadCalibration(const std::string &path) {
+	FileStorage fs(path, FileStorage::READ);
+	if (!fs.isOpened()) {
+		LOG_ERR("Calibration " << path << " cannot be read.");
+		return false;
+	}
+	return readCalibration(fs);
+}
+
+bool Processor::isCheckpointAfter(int fidx) const {
+	return checkpointFrames > 0 && fidx+1 < ttlFrmsCnt && (fidx+1-startFrmsCnt) % checkpointFrames == 0;
+}
+
+std::string Processor::getPartPath(int part) const {
+	size_t dot = outputVideoPath.rfind('.');
+	if (dot == std::string::npos) dot = outputVideoPath.size();
+	std::string ret;
+	GET_STR(outputVideoPath.substr(0, dot) << ".part" << part << outputVideoPath.substr(dot), ret);
+	return ret;
+}
+
+void Processor::setCheckpoint(const std::string &path, int seconds) {
+	assert(!videoSink.empty());	// after setPaths()
+	checkpointPath = path;
+	checkpointSeconds = seconds;
+	firstPart = curPart = 0;
+	videoSink->setPath(getPartPath(curPart));
+}
+
+void Processor::snapshotCheckpoint(int nextFrame, int part) {
+	FileStorage fs(".yml", FileStorage::WRITE | FileStorage::MEMORY);
+	fs << "nextFrame" << nextFrame << "endFrame" << ttlFrmsCnt << "part" << part;
+	fs << "parts" << "[";
+	for (int k=0; k<=part; ++k) fs << getPartPath(k);
+	fs << "]";
+	writeCalibration(fs);
+	std::lock_guard<std::mutex> lock(checkpointMutex);
+	checkpointSnapshots[nextFrame] = std::make_pair(part, fs.releaseAndGetString());
+}
+
+void Processor::checkpoint(int nextFrame) {
+	int part;
+	std::string content;
+	{
+		std::lock_guard<std::mutex> lock(checkpointMutex);
+		auto it = checkpointSnapshots.find(nextFrame);
+		if (it == checkpointSnapshots.end()) return;
+		part = it->second.first;
+		content = it->second.second;
+		checkpointSnapshots.erase(it);
+	}
+	// Every frame before nextFrame is written, the part can be closed. The part goes on as the
+	// snapshot says, so a resume writes the part the run would have
+	persistPano(true);
+	if (!videoSink->reopen(getPartPath(part))) {
+		LOG_ERR("Part " << part << " cannot be written, no checkpoint at frame " << nextFrame << ".");
+		return;
+	}
+	curPart = part;
+	if (writeCheckpoint(content)) LOG_MESS("Checkpoint at frame " << nextFrame << ", going on in part " << curPart << ".");
+}
+
+bool Processor::writeCheckpoint(const std::string &content) {
+	// Written aside then moved over in one step, a failure at any point leaves the previous checkpoint
+	std::string tmp = checkpointPath + ".tmp";
+	{
+		std::ofstream ofs(tmp.c_str());
+		ofs << content;
+		ofs.close();
+		if (!ofs) {
+			LOG_ERR("Checkpoint cannot be written to " << tmp << ".");
+			return false;
+		}
+	}
+	if (!FileUtil::replaceFile(tmp, checkpointPath)) {
+		LOG_ERR("Checkpoint cannot be moved to " << checkpointPath << ".");
+		return false;
+	}
+	return true;
+}
+
+bool Processor::resume() {
+	FileStorage fs(checkpointPath, FileStorage::READ);
+	if (!fs.isOpened()) {
+		LOG_ERR("No checkpoint to resume from at " << checkpointPath << ".");
+		return false;
+	}
+	int nextFrame, endFrame;
+	fs["nextFrame"] >> nextFrame;
+	fs["endFrame"] >> endFrame;
+	fs["part"] >> firstPart;
+	if (nextFrame >= endFrame) {
+		LOG_MESS("Checkpoint " << checkpointPath << " is of a finished run.");
+		return true;
+	}
+	// Seeded with the stitching state reached, or estimated again from nextFrame
+	if (!readCalibration(fs)) LOG_WARN("No stitching calibration in the checkpoint, it is estimated again.");
+	curPart = firstPart;
+	videoSink->setPath(getPartPath(curPart));
+	LOG_MESS("Resuming from frame " << nextFrame << " in part " << curPart << ".");
+	processFrames(nextFrame, endFrame);
+	return true;
 }
 
 void Processor::setPaths(std::string inputPaths[], int inputCnt, std::string outputPath) {
@@ -42,9 +232,12 @@ void Processor::setPaths(std::string inputPaths[], int inputCnt, std::string out
 	assert(CAMERA_CNT == inputCnt);
 	
 	
-	vWriter = VideoWriter(
-		outputPath, CV_FOURCC('D', 'I', 'V', 'X'),
-		fps = vCapture[0].get(CV_CAP_PROP_FPS), dstPanoSize);
+	captureFps = vCapture[0].get(CV_CAP_PROP_FPS);
+	fps = (int)captureFps;
+	outputVideoPath = outputPath;
+	videoSink = new VideoWriterSink(outputPath, CV_FOURCC('D', 'I', 'V', 'X'));
+	outputWriter.addSink(videoSink);
+	outputWriter.addSink(new ImageSequenceSink(OUTPUT_PATH, ".jpg"));
 
 
 #ifdef FISHEYE_DESHAKE
@@ -62,16 +255,43 @@ void Processor::setPaths(std::string inputPaths[], int inputCnt, std::string out
 	std::cout << "\t" << outputPath << std::endl;
 }
 
-void Processor::fisheyeCorrect(Mat &src, Mat &dst) {
+bool Processor::calibrateVignetting(const std::string &flatFieldClip) {
+	VideoCapture cap(flatFieldClip);
+	Mat frm;
+	if (!cap.read(frm)) {
+		LOG_ERR("Flat-field clip " << flatFieldClip << " cannot be read.");
+		return false;
+	}
+	cap.release();
+	// Same lens and mount as the inputs, the circle is found the same way. At the clip's scale,
+	// the circle of the inputs is kept
+	Point2i center;
+	int radius;
+	findFisheyeCircleRegion(frm, center, radius);
+	VignettingProfile vignetting;
+	if (!vignetting.calibrate(flatFieldClip, center, radius)) return false;
+	vignetting.save(VIGNETTING_PROFILE_PATH);
+	correctingUtil.setVignetting(vignetting);
+	return true;
+}
+
+void Processor::fisheyeCorrect(CorrectingUtil &corrector, Mat &src, Mat &dst, Point2d drift) {
 	//TODO: To apply different type of correction
 	CorrectingParams cp = CorrectingParams(
 		PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_REVERSED,
 		centerOfCircleAfterResz,
 		radiusOfCircle,
 		LONG_LAT);
+	cp.interType = CORRECT_INTER_BILINEAR;
+	// src is the decoded frame, the table takes care of resizing and cropping the circle square
+	cp.setSrcTransform(src.size(), inputFisheyeResize,
+		Rect(centerOfCircleBeforeResz.x-radiusOfCircle, centerOfCircleBeforeResz.y-radiusOfCircle,
+			2*radiusOfCircle, 2*radiusOfCircle));
+	// Drift moves the existing table instead of regenerating it
+	cp.srcShift = Point2d(drift.x*cp.srcScale.x, drift.y*cp.srcScale.y);
 	//cp.use_reMap = false;
 	//cp.w = Point2d(90*PI/180, 90*PI/180);
-	correctingUtil.doCorrect(src, dst, cp);
+	corrector.doCorrect(src, dst, cp);
 }
 
 // Return value indicates whether curStitchingIdx in move forward
@@ -87,15 +307,20 @@ bool Processor::panoStitch(std::vector<Mat> &srcs, int frameIdx) {
 
 	pLSIG->addToWaitingBuff(frameIdx, srcs);
 	std::vector<Mat> vmat, modifiedSrcs(srcs);
+	// A seeded LSIG has its calibration, no window has to be estimated first
+	bool isSeeded = pLSIG->isSeeded();
 	//ImageUtil::batchOperation(modifiedSrcs, modifiedSrcs, &ImageUtil::equalizeHistBGR);
-	Mat dummy, tmpDst;
+	Mat dummy;
 	int leftIdx, rightIdx;
 	calculateWinSz(curStitchingIdx, leftIdx, rightIdx);
 #ifdef TRY_CATCH
 	try {
 #endif
 		stitchingUtil.osParam.isRealStitching = false;
-		if (!pLSIG->cover(leftIdx, rightIdx)) {
+		// A placeholder (srcs empty) counts as a failed estimation
+		if (srcs.empty()) {
+			if (!isSeeded && !pLSIG->cover(leftIdx, rightIdx)) pLSIG->push_back(frameIdx,sInfoGOUT);
+		} else if (!isSeeded && !pLSIG->cover(leftIdx, rightIdx)) {
 			sInfoGOUT = stitchingUtil.doStitch(
 					modifiedSrcs, dummy, 
 					sInfoGIN,
@@ -113,7 +338,7 @@ bool Processor::panoStitch(std::vector<Mat> &srcs, int frameIdx) {
 #endif
 
 	calculateWinSz(curStitchingIdx, leftIdx, rightIdx);
-	if  (!pLSIG->cover(leftIdx, rightIdx)) {
+	if  (!isSeeded && !pLSIG->cover(leftIdx, rightIdx)) {
 		LOG_WARN("StitchingBuff does not cover the need. Required:" <<leftIdx<<"-"<<rightIdx <<\
 			", Current:" << pLSIG->getCovered().first << "-" << pLSIG->getCovered().second);
 		return false;
@@ -123,101 +348,267 @@ bool Processor::panoStitch(std::vector<Mat> &srcs, int frameIdx) {
 		do {
 			bool b = pLSIG->getFromWaitingBuff(curStitchingIdx, vmat);
 			assert(b);
-			sInfoGIN = pLSIG->getAver(leftIdx, rightIdx, selFrame, stitchingUtil);
-			LOG_MESS("Stitching "<< curStitchingIdx << " frame using " <<vec2str(selFrame) << "frames.");
-			stitchingUtil.doStitch(
-				vmat, tmpDst, 
-				sInfoGIN,
-				sp,
-				sType);
-			panoRefine(tmpDst, tmpDst);
-			pLSIG->addToStitchedBuff(curStitchingIdx, tmpDst);
-			LOG_MARK("Done stitching " << curStitchingIdx << " frame.");
-			persistPano();
+			Mat tmpDst;	// a new one each time, it is still being refined while the next is stitched
+			// A failed frame goes on empty, as refining does, so that the later stages keep their order
+			if (vmat.empty()) {
+				LOG_WARN("Frame " << curStitchingIdx << " failed before stitching, skipped.");
+			} else {
+				sInfoGIN = pLSIG->getAver(leftIdx, rightIdx, selFrame, stitchingUtil);
+				LOG_MESS("Stitching "<< curStitchingIdx << " frame using " <<vec2str(selFrame) << "frames.");
+#ifdef TRY_CATCH
+				try {
+#endif
+					stitchingUtil.doStitch(
+						vmat, tmpDst, 
+						sInfoGIN,
+						sp,
+						sType);
+#ifdef TRY_CATCH
+				} catch (cv::Exception e) {
+					LOG_ERR("Stitching failed at " << curStitchingIdx << " frame: " << e.what());
+					tmpDst.release();
+				}
+#endif
+			}
+			// Before the frame is queued, so that the encoder finds it along with the frame
+			if (isCheckpointAfter(curStitchingIdx))
+				snapshotCheckpoint(curStitchingIdx+1, firstPart + (curStitchingIdx+1-startFrmsCnt)/checkpointFrames);
+			stitchedQueue.push(std::make_pair(curStitchingIdx, tmpDst));
+			// On this thread, the waiting buffer is only touched by stitching
+			pLSIG->collectGarbage(curStitchingIdx);
 			calculateWinSz(++curStitchingIdx, leftIdx, rightIdx);
 		} while(curStitchingIdx<ttlFrmsCnt
-			&& pLSIG->cover(leftIdx, rightIdx)
+			&& (isSeeded || pLSIG->cover(leftIdx, rightIdx))
 			&& pLSIG->isExistInWaitingBuff(curStitchingIdx));
 		return true;
 	}
 }
 
 void Processor::panoRefine(Mat &srcImage, Mat &dstImage) {
-	Mat tmp, tmp2;
-	tmp = srcImage.clone();
-	ImageUtil::resize(tmp, tmp, dstPanoSize,0,0);
+	// Resized straight into a pooled buffer, then refined in place
+	Mat tmp = FramePool::acquire(dstPanoSize, srcImage.type());
+	ImageUtil::resize(srcImage, tmp, dstPanoSize,0,0);
 	//ImageUtil::equalizeHistBGR(tmp,tmp);
 	ImageUtil::brightnessAndContrastAuto(tmp,tmp);
 	ImageUtil::USM(tmp,tmp);
 	//ImageUtil::LaplaceEnhannce(tmp,tmp);
-	dstImage = tmp.clone();
+	dstImage = tmp;
 }
 
-void Processor::process(int maxSecondsCnt, int startFrame) {
-	std::vector<Mat> srcFrms(CAMERA_CNT);
-	std::vector<Mat> dstFrms(CAMERA_CNT);
-	ttlFrmsCnt = fps*(maxSecondsCnt)+startFrame;
-	curStitchingIdx = startFrmsCnt = startFrame;
-	int fIndex = 0;
-	while (fIndex < startFrame) {
-		Mat tmp;
-		for (int i=0; i<CAMERA_CNT; ++i) {
-			vCapture[i] >> tmp;
+bool Processor::seekToFrame(VideoCapture &cap, int frame) {
+	int pos = (int)cap.get(CV_CAP_PROP_POS_FRAMES);
+	if (pos == frame) return true;
+	int64 t = getTickCount();
+	// The backend lands on the keyframe before the target and decodes up to it
+	int target = max(0, frame - SEEK_PREROLL_FRAMES);
+	if (pos > frame || target > pos) {
+		if (cap.set(CV_CAP_PROP_POS_FRAMES, target)) pos = (int)cap.get(CV_CAP_PROP_POS_FRAMES);
+		if (pos < 0 || pos > frame) {
+			LOG_WARN("Seeking to " << target << " landed on " << pos << ", stepping from the start.");
+			cap.set(CV_CAP_PROP_POS_FRAMES, 0);
+			pos = 0;
 		}
-		fIndex++;
 	}
+	// grab() only, the skipped frames are never converted
+	while (pos < frame && cap.grab()) ++pos;
+	LOG_MESS("Seeked to frame " << pos << " in " << (getTickCount()-t)*1000/getTickFrequency() << " ms.");
+	return pos == frame;
+}
 
-	while (fIndex < ttlFrmsCnt) {
-		// frame by frame
-		LOG_MARK("Processing " << fIndex  << "/" << ttlFrmsCnt-1 << " frame ...");
+void Processor::decodeStage(int camIdx, int fromFrame) {
+	Size frmSize;
+	int frmType = -1;
+	for (int fidx=fromFrame; fidx<ttlFrmsCnt; ++fidx) {
+		Mat frm, src;
+		// A free buffer each time, later reads leave it alone
+		if (frmType >= 0) frm = FramePool::acquire(frmSize, frmType);
+		vCapture[camIdx] >> frm;
+		if (frm.empty()) break;
+		frmSize = frm.size();
+		frmType = frm.type();
+		preProcess(frm, src);
+		if (CIRCLE_REDETECT_SECONDS > 0
+			&& (fidx-startFrmsCnt) % max(1, fps*CIRCLE_REDETECT_SECONDS) == 0)
+			trackCircleDrift(camIdx, src);
+		if (!decodedQueue[camIdx].push(DecodedFrame(src, circleDrift[camIdx]))) break;
+	}
+	decodedQueue[camIdx].close();
+}
+
+void Processor::correctStage(CorrectingUtil &corrector) {
+	while (true) {
+		std::vector<DecodedFrame> srcFrms(CAMERA_CNT);
+		int fidx;
+		{
+			std::lock_guard<std::mutex> lock(pairingMutex);
+			if (isPairingEnded) return;
+			int popped = 0;
+			while (popped < CAMERA_CNT && decodedQueue[popped].pop(srcFrms[popped])) ++popped;
+			if (popped < CAMERA_CNT) {
+				// One input has ended, release the decoders of the others. nextPairedIdx is not taken,
+				// the stitching stops before it once every worker is out
+				if (popped > 0)
+					LOG_WARN("Input " << popped << " ended before frame " << nextPairedIdx
+						<< ", frame " << nextPairedIdx << " and later ones of the other inputs are dropped.");
+				isPairingEnded = true;
+				for (int i=0; i<CAMERA_CNT; ++i) decodedQueue[i].close();
+				return;
+			}
+			fidx = nextPairedIdx++;
+		}
+		std::vector<Mat> dstFrms(CAMERA_CNT);
 #ifdef TRY_CATCH
 		try {
 #endif
-			std::vector<Mat> tmpFrms(CAMERA_CNT);
-			Mat dstImage;
-
 			for (int i=0; i<CAMERA_CNT; ++i) {
-				vCapture[i] >> tmpFrms[i];
-				if (tmpFrms[i].empty()) break;
-				preProcess(tmpFrms[i], tmpFrms[i]);
-		
-				/* Restrict to square frame */
-				srcFrms[i] = tmpFrms[i](
-					/* row */
-					Range(centerOfCircleBeforeResz.y-radiusOfCircle, centerOfCircleBeforeResz.y+radiusOfCircle),
-					/* col */
-					Range(centerOfCircleBeforeResz.x-radiusOfCircle, centerOfCircleBeforeResz.x+radiusOfCircle))
-					.clone();	// must use clone()
-		
-			
-				dstFrms[i].create(srcFrms[i].rows, srcFrms[i].cols, srcFrms[i].type());
+				/* Restrict to square frame, the square is cropped by correction itself */
+				dstFrms[i] = FramePool::acquire(2*radiusOfCircle, 2*radiusOfCircle, srcFrms[i].first.type());
+				fisheyeCorrect(corrector, srcFrms[i].first, dstFrms[i], srcFrms[i].second);
 			}
+#ifdef TRY_CATCH
+		} catch (cv::Exception e) {
+			LOG_ERR("correct "<< fidx  << "/" << ttlFrmsCnt << " frame: " <<e.what());
+			dstFrms.clear();
+		} catch (...) {
+			LOG_ERR("correct "<< fidx  << "/" << ttlFrmsCnt << " frame: UNKNOWN");
+			dstFrms.clear();
+		}
+#endif
+		if (!correctedBuff.put(fidx, dstFrms)) return;
+	}
+}
 
-			// Hardcode: Use 1st to set centerOfCircleAfterResz
-			static bool isSetCenter = false;
-			if (!isSetCenter) {
-				centerOfCircleAfterResz.x = srcFrms[0].cols/2;
-				centerOfCircleAfterResz.y = srcFrms[0].rows/2;
-				isSetCenter = true;
-			}
-			LOG_MESS("\tCorrecting ..." );
-			for (int i=0; i<CAMERA_CNT; ++i) {
-				/*blackenOutsideRegion(srcFrms[i]);*/
-				fisheyeCorrect(srcFrms[i], dstFrms[i]);
-				//ImageUtil::imshow("dstFrm",dstFrms[i],0.5,true);
-				
-			}
+void Processor::refineStage() {
+	std::pair<int, Mat> stitched;
+	while (stitchedQueue.pop(stitched)) {
+		Mat pano;
+		if (stitched.second.empty()) {	// placeholder, see panoStitch()
+			if (!refinedBuff.put(stitched.first, pano)) return;
+			continue;
+		}
+#ifdef TRY_CATCH
+		try {
+#endif
+			panoRefine(stitched.second, pano);
+#ifdef TRY_CATCH
+		} catch (cv::Exception e) {
+			LOG_ERR("refine "<< stitched.first << " frame: " <<e.what());
+			pano.release();
+		} catch (...) {
+			LOG_ERR("refine "<< stitched.first << " frame: UNKNOWN");
+			pano.release();
+		}
+#endif
+		if (!refinedBuff.put(stitched.first, pano)) return;
+	}
+}
+
+void Processor::encodeStage() {
+	int fidx;
+	Mat pano;
+	while (refinedBuff.take(fidx, pano)) {
+		if (!pano.empty()) {
+			pLSIG->addToStitchedBuff(fidx, pano);
+			LOG_MARK("Done stitching " << fidx << " frame.");
+			persistPano();
+		}
+		if (isCheckpointAfter(fidx)) checkpoint(fidx+1);
+		if ((fidx-startFrmsCnt) % max(1, fps) == 0) FramePool::report();
+	}
+	persistPano(true);	//final flush
+	FramePool::report();
+}
+
+void Processor::process(int maxSecondsCnt, int startFrame) {
+	processFrames(startFrame, fps*(maxSecondsCnt)+startFrame);
+}
+
+void Processor::processFrames(int startFrame, int endFrame) {
+	ttlFrmsCnt = endFrame;
+	curStitchingIdx = startFrmsCnt = startFrame;
+	checkpointFrames = checkpointPath.empty() ? 0 : max(1, fps*checkpointSeconds);
+	checkpointSnapshots.clear();
+	int fIndex = startFrame;
+	if (fIndex >= ttlFrmsCnt) return;
+	outputWriter.open(captureFps, dstPanoSize);
+	for (int i=0; i<CAMERA_CNT; ++i) {
+		if (!seekToFrame(vCapture[i], startFrame)) {
+			LOG_ERR("Input " << i << " cannot reach frame " << startFrame << ".");
+			return;
+		}
+	}
+
+	// The circle is found and the table generated on the first frames, before fanning out.
+	// Found again in every run, several Processors may render in one process
+	isFoundFisheyeRegion = false;
+	std::vector<Mat> srcFrms(CAMERA_CNT);
+	for (int i=0; i<CAMERA_CNT; ++i) {
+		Mat frm;
+		vCapture[i] >> frm;
+		if (frm.empty()) {
+			LOG_ERR("Input " << i << " has no frame from " << fIndex << ".");
+			return;
+		}
+		preProcess(frm, srcFrms[i]);
+		if (CIRCLE_REDETECT_SECONDS > 0) trackCircleDrift(i, srcFrms[i]);
+	}
+	centerOfCircleAfterResz.x = radiusOfCircle;
+	centerOfCircleAfterResz.y = radiusOfCircle;
+	{
+		// Also settles table or computing, once for all the correcting workers
+		Mat warmUp(2*radiusOfCircle, 2*radiusOfCircle, srcFrms[0].type());
+		fisheyeCorrect(correctingUtil, srcFrms[0], warmUp, circleDrift[0]);
+	}
+
+	for (int i=0; i<CAMERA_CNT; ++i) {
+		decodedQueue[i].reset();
+		decodedQueue[i].setCapacity(PIPELINE_QUEUE_DEPTH);
+		decodedQueue[i].push(DecodedFrame(srcFrms[i], circleDrift[i]));
+	}
+	nextPairedIdx = fIndex;
+	isPairingEnded = false;
+	correctedBuff.reset(fIndex, PIPELINE_CORRECT_WORKERS + PIPELINE_QUEUE_DEPTH);
+	stitchedQueue.reset();
+	stitchedQueue.setCapacity(PIPELINE_QUEUE_DEPTH);
+	refinedBuff.reset(curStitchingIdx, PIPELINE_REFINE_WORKERS + PIPELINE_QUEUE_DEPTH);
+
+	std::vector<std::thread> decoders, correctors, refiners;
+	for (int i=0; i<CAMERA_CNT; ++i) decoders.push_back(std::thread(&Processor::decodeStage, this, i, fIndex+1));
+	// Worker 0 keeps the generated table, the others map its persisted file
+	std::vector<Ptr<CorrectingUtil>> correctingUtils;
+	for (int w=1; w<PIPELINE_CORRECT_WORKERS; ++w) correctingUtils.push_back(correctingUtil.fork());
+	std::atomic<int> correctorsLeft(PIPELINE_CORRECT_WORKERS), refinersLeft(PIPELINE_REFINE_WORKERS);
+	for (int w=0; w<PIPELINE_CORRECT_WORKERS; ++w) {
+		CorrectingUtil *corrector = w == 0 ? &correctingUtil : correctingUtils[w-1].get();
+		correctors.push_back(std::thread([this, corrector, &correctorsLeft]{
+			correctStage(*corrector);
+			if (--correctorsLeft == 0) correctedBuff.close();
+		}));
+	}
+	for (int w=0; w<PIPELINE_REFINE_WORKERS; ++w) {
+		refiners.push_back(std::thread([this, &refinersLeft]{
+			refineStage();
+			if (--refinersLeft == 0) refinedBuff.close();
+		}));
+	}
+	std::thread encoder(&Processor::encodeStage, this);
+
+	// Stitching keeps state from frame to frame, it runs here in order
+	std::vector<Mat> dstFrms;
+	while (correctedBuff.take(fIndex, dstFrms)) {
+		LOG_MARK("Processing " << fIndex  << "/" << ttlFrmsCnt-1 << " frame ...");
+		// Empty when correcting failed (logged already), stitching passes it on as a placeholder
+#ifdef TRY_CATCH
+		try {
+#endif
 	#ifdef FISHEYE_DESHAKE 
-			for (int i=0; i<CAMERA_CNT; ++i) {
+			for (int i=0; i<(int)dstFrms.size(); ++i) {
 				vWriterDeshakeTemp[i] << dstFrms[i];
 			}
 	#else
 			LOG_MESS("\tStitching ...");
 			panoStitch(dstFrms, fIndex);
-			/*vWriter << dstFrms[1];*/
 	#endif
-
-
 #ifdef TRY_CATCH
 		} catch (cv::Exception e) {
 			
@@ -226,9 +617,9 @@ void Processor::process(int maxSecondsCnt, int startFrame) {
 			LOG_ERR("process "<< fIndex  << "/" << ttlFrmsCnt << " frame: UNKNOWN");
 		}
 #endif
-		
-		++fIndex;
 	}
+	for (size_t k=0; k<decoders.size(); ++k) decoders[k].join();
+	for (size_t k=0; k<correctors.size(); ++k) correctors[k].join();
 
 #ifdef FISHEYE_DESHAKE
 	for (int i=0; i<CAMERA_CNT; ++i) {
@@ -239,6 +630,7 @@ void Processor::process(int maxSecondsCnt, int startFrame) {
 	}
 
 	fIndex = startFrame;
+	dstFrms.resize(CAMERA_CNT);
 	while (fIndex < ttlFrmsCnt) {
 		LOG_MARK("Processing " << fIndex  << "/" << ttlFrmsCnt-1 << " frame ...");
 		for (int i=0; i<CAMERA_CNT; ++i) {
@@ -251,8 +643,16 @@ void Processor::process(int maxSecondsCnt, int startFrame) {
 	}
 #endif
 
-
-	persistPano(true);	//final flush
+	// Refining and encoding drain what was stitched, the encoder flushes at the end
+	stitchedQueue.close();
+	for (size_t k=0; k<refiners.size(); ++k) refiners[k].join();
+	encoder.join();
+	// Marks the run finished, listing all the parts, once the last one is closed
+	if (checkpointFrames > 0) {
+		outputWriter.close();
+		snapshotCheckpoint(ttlFrmsCnt, curPart);
+		writeCheckpoint(checkpointSnapshots[ttlFrmsCnt].second);
+	}
 }
 
 void Processor::persistPano(bool isFlush) {
@@ -270,31 +670,35 @@ void Processor::persistPano(bool isFlush) {
 		cvWaitKey();
 #endif
 			
-		std::string dstname;
-		GET_STR(OUTPUT_PATH << fidx << ".jpg", dstname);
-		LOG_MESS("Persisting " << fidx << ".jpg.");
-		imwrite(dstname, dstImage);
-
-		vWriter << dstImage;
+		LOG_MESS("Persisting " << fidx << " frame.");
+		outputWriter.write(fidx, dstImage);
 	}
 	pLSIG->clearStitchedBuff();
+	if (isFlush) outputWriter.flush();
 }
 
 void Processor::preProcess(Mat &src, Mat &dst) {
-	static bool isFoundFisheyeRegion = false;
-	ImageUtil::resize(src, dst, inputFisheyeResize);
 	if (!isFoundFisheyeRegion) {
-		findFisheyeCircleRegion(dst);
+		Mat resized;
+		ImageUtil::resize(src, resized, inputFisheyeResize);
+		findFisheyeCircleRegion(resized);
 		isFoundFisheyeRegion = true;
 	}
+	// No resize nor copy, correction reads the decoded frame directly.
+	// Every read goes to a new Mat, which stays valid while the next ones are decoded
+	dst = src;
 }
 
 void Processor::blackenOutsideRegion(Mat &src) {
-	Mat_<Vec3b> tmpSrc =src;
-	for (int i=0; i<tmpSrc.size().width; ++i) 
-		for (int j=0; j<tmpSrc.size().height; ++j) {
-			if (square(i-centerOfCircleAfterResz.x) + square(j-centerOfCircleAfterResz.y) > square(radiusOfCircle)*1.01)
-				tmpSrc(Point(i,j)) = Vec3b(0,0,0);
-		}
-
+	// The circle covers one span per row, blacken both sides of it
+	double r2 = square(radiusOfCircle)*1.01;
+	for (int j=0; j<src.rows; ++j) {
+		double dy2 = square(j-centerOfCircleAfterResz.y);
+		int halfWidth = dy2 > r2 ? -1 : (int)floor(sqrt(r2 - dy2));
+		int x0 = max(0, min(src.cols, centerOfCircleAfterResz.x - halfWidth));
+		int x1 = max(x0, min(src.cols, centerOfCircleAfterResz.x + halfWidth + 1));
+		if (halfWidth < 0) x0 = x1 = src.cols;
+		src.row(j).colRange(0, x0).setTo(Scalar::all(0));
+		src.row(j).colRange(x1, src.cols).setTo(Scalar::all(0));
+	}
 }
@@ -3,15 +3,43 @@
 #include "Config.h"
 #include "StitchingUtil.h"
 #include "CorrectingUtil.h"
+#include "OtherUtils\PipelineQueue.h"
+#include "OutputWriter.h"
+#include <map>
 
 
 #define INPUT_FISHEYE_RESIZE Size(INPUT_FISHEYE_LENGTH,INPUT_FISHEYE_LENGTH)
 #define OUTPUT_PANO_SIZE Size(INPUT_FISHEYE_LENGTH*2,INPUT_FISHEYE_LENGTH)
 
+/* Circle drift tracking, 0 seconds disables it */
+#define CIRCLE_REDETECT_SECONDS 5
+#define CIRCLE_DETECT_LENGTH 256		/* Longer side of the downscaled frame detection runs on */
+#define CIRCLE_DETECT_THRESHOLD 20		/* Gray level telling the lit circle from the black border */
+#define CIRCLE_MIN_DRIFT_CHANGE 0.25	/* Below it a change is taken as detection noise, in pixels */
+#define CIRCLE_MAX_DRIFT_RATIO 0.05		/* Above radius*ratio a drift is taken as a false detection */
+
+/* Frames before startFrame a seek lands on, then stepped over by grab() to the exact one.
+   Room for backends that map frame numbers to timestamps approximately */
+#define SEEK_PREROLL_FRAMES 16
+
+/* Stages of process(): one decoding thread per camera, correcting workers, stitching on the
+   calling thread, refining workers and one encoding thread, joined by bounded queues */
+#define PIPELINE_QUEUE_DEPTH 4		/* Frames waiting between two stages */
+#define PIPELINE_CORRECT_WORKERS 4	/* Each correction is itself spread over the cores */
+#define PIPELINE_REFINE_WORKERS 4
+
+/* Default interval of setCheckpoint() */
+#define CHECKPOINT_SECONDS 60
+
+/* Vignetting profile of the lenses, loaded at start when present, see calibrateVignetting() */
+#define VIGNETTING_PROFILE_PATH (RESOURCE_PATH "vignetting.yml")
+
 class Processor {
 private:
 	VideoCapture vCapture[CAMERA_CNT];	// 0 stands for front and 1 stands for back, maybe more cam
-	VideoWriter vWriter;
+	OutputWriter outputWriter;	// pano outputs, written in the background
+	Ptr<VideoWriterSink> videoSink;
+	std::string outputVideoPath;
 
 #ifdef FISHEYE_DESHAKE
 	VideoWriter vWriterDeshakeTemp[CAMERA_CNT];
@@ -19,10 +47,16 @@ private:
 	std::string deshakeVidNameAfter[CAMERA_CNT];
 #endif
 	
+	bool isFoundFisheyeRegion;	// per run, by preProcess() on its first frame
 	int radiusOfCircle;
 	Point2i centerOfCircleBeforeResz;
 	Point2i centerOfCircleAfterResz;
+	/* Circle centers detected on the first frame and their drift since, in resized coordinates */
+	bool isCircleRefSet[CAMERA_CNT];
+	Point2d circleRefCenter[CAMERA_CNT];
+	Point2d circleDrift[CAMERA_CNT];
 	int fps;
+	double captureFps;	// as reported, e.g. 29.97 where fps counts frames by 29, given to the outputs
 	int startFrmsCnt;
 	int ttlFrmsCnt;
 	Size inputFisheyeResize;
@@ -36,22 +70,66 @@ private:
 
 	/* Pointer of <class LSIG> */
 	LocalStitchingInfoGroup *pLSIG;
+
+	/* Pipeline of process(). A decoded frame goes with the circle drift of its camera at that time */
+	typedef std::pair<Mat, Point2d> DecodedFrame;
+	BoundedQueue<DecodedFrame> decodedQueue[CAMERA_CNT];
+	std::mutex pairingMutex;	// frames of the same index are taken from all cameras at once
+	int nextPairedIdx;
+	bool isPairingEnded;	// an input has ended, no index is paired from nextPairedIdx on
+	ReorderBuffer<std::vector<Mat>> correctedBuff;	// empty when correcting failed
+	BoundedQueue<std::pair<int, Mat>> stitchedQueue;
+	ReorderBuffer<Mat> refinedBuff;	// empty when refining failed
+	/* Stage bodies, each run until its input is closed and drained */
+	void decodeStage(int camIdx, int fromFrame);
+	void correctStage(CorrectingUtil &corrector);
+	void refineStage();
+	void encodeStage();
+
+	/* Checkpoints, see setCheckpoint(). The stitching thread snapshots the state after the
+	   last frame of a part, the encoder writes it once that frame is on disk */
+	std::string checkpointPath;
+	int checkpointSeconds;
+	int checkpointFrames;	// 0 when disabled
+	int firstPart, curPart;	// part of the video the run started with, and the one written now
+	std::map<int, std::pair<int, std::string>> checkpointSnapshots;	// part and content, by the frame to resume from
+	std::mutex checkpointMutex;
+	bool isCheckpointAfter(int fidx) const;
+	std::string getPartPath(int part) const;
+	/* Progress and calibration to resume from nextFrame, kept in checkpointSnapshots */
+	void snapshotCheckpoint(int nextFrame, int part);
+	/* On the encoder, close the part up to nextFrame, go on in the part of its snapshot and write it */
+	void checkpoint(int nextFrame);
+	bool writeCheckpoint(const std::string &content);
+	/* Circle references and LSIG calibration, in saveCalibration() format */
+	bool writeCalibration(FileStorage &fs);
+	bool readCalibration(FileStorage &fs);
+	/* The process flow over frames [startFrame, endFrame) */
+	void processFrames(int startFrame, int endFrame);
 	
 	/* Detect the region of interest of fisheye input */
 	void findFisheyeCircleRegion(Mat &);
+	/* Same estimation, the Processor state left alone */
+	static void findFisheyeCircleRegion(const Mat &frm, Point2i &center, int &radius);
+	/* Centroid of the lit circle on a downscaled copy, in resized coordinates */
+	bool detectCircleCenter(Mat &frm, Point2d &center);
+	/* Update circleDrift of given camera from its current frame */
+	void trackCircleDrift(int camIdx, Mat &frm);
 	/* Blacken the pixel outside fisheye ROI */
 	void blackenOutsideRegion(Mat &);
-	/* Calibrate fisheye distortedness */
-	void fisheyeCorrect(Mat &src, Mat &dst);
+	/* Calibrate fisheye distortedness, corrector being owned by the calling thread */
+	void fisheyeCorrect(CorrectingUtil &corrector, Mat &src, Mat &dst, Point2d drift);
 	/* Apply some pre-process to input */
 	void preProcess(Mat &src, Mat &dst);
-	/* Stitch */
+	/* Stitch, the stitched frames go to stitchedQueue */
 	bool panoStitch(std::vector<Mat> &srcs, int frameIdx);
 	/* Apply some refinement to pano */
 	void panoRefine(Mat &, Mat &dstImage);
+	/* Position cap right before frame, seeking to a keyframe then grabbing without decoding to color */
+	bool seekToFrame(VideoCapture &cap, int frame);
 	/* Calculate windows boundaries for given fidx */
 	void calculateWinSz(int fidx, int &lidx, int &ridx);
-	/* Persist final pano to disk */
+	/* Hand the stitched panos over to outputWriter, flushing waits until they are on disk */
 	void persistPano(bool isFlush = false);
 
 public:
@@ -59,6 +137,21 @@ public:
 	~Processor();
 	/* Set input/output path inpfomation and some initialization */
 	void setPaths(std::string inputPaths[], int inputCnt, std::string outputPath);
+	/* Stitching calibration and circle references, saved from one run to seed others
+	   (e.g. the segments of SegmentDriver) so that they all render alike */
+	bool saveCalibration(const std::string &path);
+	bool loadCalibration(const std::string &path);
+	/* Attach another output besides the video and JPEGs of setPaths(), before process() */
+	void addOutputSink(const Ptr<OutputSink> &sink) {outputWriter.addSink(sink);}
+	/* Calibrate the lens shading once from a clip of a flat, evenly lit target shot by the same lens,
+	   then correct it during fisheye correction. Saved to VIGNETTING_PROFILE_PATH for later runs */
+	bool calibrateVignetting(const std::string &flatFieldClip);
+	/* Checkpoint every given seconds of output to path, after setPaths(). The video is then written
+	   in parts <output>.partN.<ext>, one per checkpoint, closed and playable once it is checkpointed */
+	void setCheckpoint(const std::string &path, int seconds = CHECKPOINT_SECONDS);
+	/* Continue from the checkpoint of setCheckpoint() after a failure, instead of process(). The part
+	   being written then is written anew, false if there is no checkpoint */
+	bool resume();
 	/* The whole process flow */
 	void process(int maxSecCnt = INT_MAX, int startSecond = 0);
 };
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include "SegmentDriver.h"
+#include "Processor.h"
+#include "OtherUtils\FileUtil.h"
+#include <io.h>
+#include <fcntl.h>
+#include <sys\stat.h>
+#include <process.h>
+#include <sys\utime.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+bool SegmentDriver::Job::save(const std::string &path) const {
+	FileStorage fs(path, FileStorage::WRITE);
+	if (!fs.isOpened()) return false;
+	fs << "inputs" << "[";
+	for (size_t i=0; i<inputs.size(); ++i) fs << inputs[i];
+	fs << "]";
+	fs << "calibration" << calibration;
+	fs << "segments" << "[";
+	for (size_t k=0; k<segments.size(); ++k) {
+		fs << "{" << "startFrame" << segments[k].startFrame
+			<< "seconds" << segments[k].seconds
+			<< "output" << segments[k].output << "}";
+	}
+	fs << "]";
+	return true;
+}
+
+bool SegmentDriver::Job::load(const std::string &path) {
+	FileStorage fs(path, FileStorage::READ);
+	if (!fs.isOpened()) return false;
+	inputs.clear();
+	segments.clear();
+	FileNode n = fs["inputs"];
+	for (FileNodeIterator it=n.begin(); it!=n.end(); ++it) inputs.push_back((std::string)*it);
+	fs["calibration"] >> calibration;
+	n = fs["segments"];
+	for (FileNodeIterator it=n.begin(); it!=n.end(); ++it) {
+		Segment seg;
+		(*it)["startFrame"] >> seg.startFrame;
+		(*it)["seconds"] >> seg.seconds;
+		(*it)["output"] >> seg.output;
+		segments.push_back(seg);
+	}
+	return inputs.size() == CAMERA_CNT && !segments.empty();
+}
+
+bool SegmentDriver::isFileExist(const std::string &path) {
+	return _access(path.c_str(), 0) == 0;
+}
+
+std::string SegmentDriver::workerName(int pid) {
+	char host[MAX_COMPUTERNAME_LENGTH+1] = "";
+	DWORD len = sizeof(host);
+	GetComputerNameA(host, &len);
+	std::string name;
+	GET_STR(host << ":" << pid, name);
+	return name;
+}
+
+std::string SegmentDriver::lockOwner(const Segment &seg) {
+	std::string owner;
+	std::ifstream(lockFile(seg)) >> owner;
+	return owner;
+}
+
+bool SegmentDriver::calibrate(Job &job, const std::string &jobDir) {
+	std::vector<std::string> inputs(job.inputs);
+	std::string path = jobDir + "calibration.yml";
+	Ptr<LocalStitchingInfoGroup> lsig(new LocalStitchingInfoGroup());
+	Ptr<Processor> processor(new Processor(lsig.get()));
+	processor->setPaths(&inputs[0], (int)inputs.size(), jobDir + "calibration.avi");
+	processor->process(SEGMENT_CALIBRATION_SECONDS, 0);
+	if (!processor->saveCalibration(path)) return false;
+	job.calibration = path;
+	return true;
+}
+
+bool SegmentDriver::renderSegment(const Job &job, const Segment &seg) {
+	std::vector<std::string> inputs(job.inputs);
+	Ptr<LocalStitchingInfoGroup> lsig(new LocalStitchingInfoGroup());
+	Ptr<Processor> processor(new Processor(lsig.get()));
+	processor->setPaths(&inputs[0], (int)inputs.size(), seg.output);
+	if (!job.calibration.empty() && !processor->loadCalibration(job.calibration))
+		LOG_WARN("Segment " << seg.output << " is rendered without calibration, its seam may differ.");
+	processor->process(seg.seconds, seg.startFrame);
+	processor.release();
+	// process() does not report failures, the segment counts once it has frames
+	VideoCapture cap(seg.output);
+	return cap.isOpened() && cap.get(CV_CAP_PROP_FRAME_COUNT) > 0;
+}
+
+bool SegmentDriver::concatenate(const Job &job, const std::string &output) {
+	VideoWriter writer;
+	Mat frm;
+	for (size_t k=0; k<job.segments.size(); ++k) {
+		VideoCapture cap(job.segments[k].output);
+		if (!cap.isOpened()) {
+			LOG_ERR("Segment " << job.segments[k].output << " cannot be read.");
+			return false;
+		}
+		while (cap.read(frm)) {
+			if (!writer.isOpened()
+				&& !writer.open(output, CV_FOURCC('D', 'I', 'V', 'X'), cap.get(CV_CAP_PROP_FPS), frm.size())) {
+				LOG_ERR(output << " cannot be written.");
+				return false;
+			}
+			writer << frm;
+		}
+	}
+	return writer.isOpened();
+}
+
+int SegmentDriver::drive(const char *exe, int workers, int segmentCnt, int seconds,
+	const std::string &output, const std::vector<std::string> &inputs) {
+	if (inputs.size() != CAMERA_CNT) {
+		LOG_ERR("SegmentDriver: " << CAMERA_CNT << " inputs are expected, " << inputs.size() << " given.");
+		return 1;
+	}
+	std::string jobDir = output + ".segments\\";
+	if (!FileUtil::findOrCreateDir(jobDir.c_str())) return 1;
+	VideoCapture cap(inputs[0]);
+	if (!cap.isOpened()) {
+		LOG_ERR("SegmentDriver: " << inputs[0] << " cannot be read.");
+		return 1;
+	}
+	int fps = (int)cap.get(CV_CAP_PROP_FPS);
+	if (seconds <= 0) seconds = (int)ceil(cap.get(CV_CAP_PROP_FRAME_COUNT)/max(1, fps));
+	cap.release();
+
+	Job job;
+	job.inputs = inputs;
+	int64 t = getTickCount();
+	if (!calibrate(job, jobDir)) LOG_WARN("SegmentDriver: calibration not settled, segments are rendered unseeded.");
+	LOG_MESS("SegmentDriver: calibrated in " << (getTickCount()-t)/getTickFrequency() << " s.");
+
+	// Whole seconds, process() counts in seconds
+	int segSeconds = max(1, (seconds+max(1, segmentCnt)-1)/max(1, segmentCnt));
+	for (int s=0; s<seconds; s+=segSeconds) {
+		Segment seg;
+		seg.startFrame = fps*s;
+		seg.seconds = min(segSeconds, seconds-s);
+		GET_STR(jobDir << "segment" << job.segments.size() << ".avi", seg.output);
+		// Markers of an earlier run of the same job
+		remove(lockFile(seg).c_str());
+		remove(doneFile(seg).c_str());
+		remove(failedFile(seg).c_str());
+		job.segments.push_back(seg);
+	}
+	std::string jobFile = jobDir + "job.yml";
+	if (!job.save(jobFile)) {
+		LOG_ERR("SegmentDriver: " << jobFile << " cannot be written.");
+		return 1;
+	}
+	LOG_MESS("SegmentDriver: " << job.segments.size() << " segments of " << segSeconds << " s in " << jobFile << ".");
+
+	t = getTickCount();
+	std::vector<intptr_t> children;
+	std::vector<int> childPids;
+	for (int w=0; w<workers; ++w) {
+		intptr_t h = _spawnl(_P_NOWAIT, exe, quote(exe).c_str(), "--worker", quote(jobFile).c_str(), NULL);
+		if (h == -1) LOG_WARN("SegmentDriver: worker " << w << " cannot be started.");
+		else {
+			children.push_back(h);
+			childPids.push_back((int)GetProcessId((HANDLE)h));
+		}
+	}
+	// The driver takes segments as well
+	work(jobFile);
+	for (size_t k=0; k<children.size(); ++k) {
+		int status;
+		_cwait(&status, children[k], _WAIT_CHILD);
+		if (status == 0) continue;
+		// A crashed worker leaves the locks of the segments it was rendering, nobody would finish them
+		std::string name = workerName(childPids[k]);
+		LOG_ERR("SegmentDriver: worker " << name << " exited with " << status << ".");
+		for (size_t s=0; s<job.segments.size(); ++s) {
+			const Segment &seg = job.segments[s];
+			if (isFinished(seg) || lockOwner(seg) != name) continue;
+			LOG_ERR("SegmentDriver: " << seg.output << " is left unfinished by " << name << ".");
+			std::ofstream(failedFile(seg));
+		}
+	}
+	// Segments claimed by workers on other machines. Their locks are checked against the local clock
+	// only, machines sharing the job directory need not agree on the time
+	std::vector<time_t> lockTimes(job.segments.size(), 0);
+	std::vector<int64> lockSeenTicks(job.segments.size(), getTickCount());
+	while (true) {
+		size_t finished = 0, failed = 0;
+		bool isReclaimed = false;
+		for (size_t k=0; k<job.segments.size(); ++k) {
+			const Segment &seg = job.segments[k];
+			if (isFileExist(doneFile(seg))) {
+				++finished;
+				continue;
+			}
+			if (isFileExist(failedFile(seg))) {
+				++finished, ++failed;
+				continue;
+			}
+			struct _stat st;
+			// Not claimed yet, or reclaimed from a dead worker
+			if (_stat(lockFile(seg).c_str(), &st) != 0) {
+				isReclaimed = true;
+				continue;
+			}
+			if (st.st_mtime != lockTimes[k]) {
+				lockTimes[k] = st.st_mtime;
+				lockSeenTicks[k] = getTickCount();
+			} else if ((getTickCount()-lockSeenTicks[k])*1000/getTickFrequency() > SEGMENT_LOCK_TIMEOUT_MS) {
+				LOG_WARN("SegmentDriver: " << lockOwner(seg) << " stopped rendering " << seg.output << ", it is rendered again.");
+				remove(lockFile(seg).c_str());
+				lockTimes[k] = 0;
+				isReclaimed = true;
+			}
+		}
+		if (isReclaimed) {
+			work(jobFile);
+			continue;
+		}
+		if (finished == job.segments.size()) {
+			if (failed) {
+				LOG_ERR("SegmentDriver: " << failed << " segments failed, see the logs of their workers.");
+				return 1;
+			}
+			break;
+		}
+		LOG_MESS("SegmentDriver: waiting for " << job.segments.size()-finished << " segments.");
+		std::this_thread::sleep_for(std::chrono::milliseconds(SEGMENT_POLL_MS));
+	}
+	LOG_MESS("SegmentDriver: rendered in " << (getTickCount()-t)/getTickFrequency() << " s.");
+
+	if (!concatenate(job, output)) return 1;
+	LOG_MARK("SegmentDriver: " << output << " done.");
+	return 0;
+}
+
+int SegmentDriver::work(const std::string &jobFile) {
+	Job job;
+	if (!job.load(jobFile)) {
+		LOG_ERR("SegmentDriver: " << jobFile << " cannot be read.");
+		return 1;
+	}
+	for (size_t k=0; k<job.segments.size(); ++k) {
+		const Segment &seg = job.segments[k];
+		if (isFileExist(doneFile(seg)) || isFileExist(failedFile(seg))) continue;
+		// Fails when the file exists, so one process only gets each segment
+		int fd = _open(lockFile(seg).c_str(), _O_CREAT | _O_EXCL | _O_WRONLY, _S_IREAD | _S_IWRITE);
+		if (fd == -1) continue;
+		std::string name = workerName(_getpid());
+		_write(fd, name.c_str(), (unsigned int)name.size());
+		_close(fd);
+		LOG_MARK("SegmentDriver: rendering " << seg.output << " from frame " << seg.startFrame << ".");
+		// Keeps the lock fresh, a lock the driver sees untouched is taken for a dead worker's
+		std::atomic<bool> isRendering(true);
+		std::thread heartbeat([&]() {
+			while (isRendering) {
+				for (int t=0; t<SEGMENT_HEARTBEAT_MS && isRendering; t+=SEGMENT_HEARTBEAT_MS/50)
+					std::this_thread::sleep_for(std::chrono::milliseconds(SEGMENT_HEARTBEAT_MS/50));
+				_utime(lockFile(seg).c_str(), NULL);
+			}
+		});
+		bool ret = renderSegment(job, seg);
+		isRendering = false;
+		heartbeat.join();
+		if (!ret) LOG_ERR("SegmentDriver: " << seg.output << " failed.");
+		std::ofstream(ret ? doneFile(seg) : failedFile(seg));
+	}
+	return 0;
+}
+
+int SegmentDriver::main(int argc, char **argv) {
+	if (argc >= 7 && !strcmp(argv[1], "--drive")) {
+		std::vector<std::string> inputs(argv+6, argv+argc);
+		return drive(argv[0], atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), argv[5], inputs);
+	}
+	if (argc == 3 && !strcmp(argv[1], "--worker")) return work(argv[2]);
+	std::cout << "Usage:" << std::endl
+		<< "\t" << argv[0] << " --drive <workers> <segments> <seconds> <output> <inputs...>" << std::endl
+		<< "\t" << argv[0] << " --worker <job.yml>" << std::endl;
+	return -1;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Config.h"
+#include <vector>
+
+/* Seconds rendered first, on one process, to settle the stitching calibration every segment is seeded with */
+#define SEGMENT_CALIBRATION_SECONDS 2
+/* Interval at which the driver checks segments rendered by other machines */
+#define SEGMENT_POLL_MS 2000
+/* A worker touches the lock of its segment at this interval while rendering it. A lock left
+   untouched for the timeout is taken for a dead worker's, and the driver renders the segment again */
+#define SEGMENT_HEARTBEAT_MS 5000
+#define SEGMENT_LOCK_TIMEOUT_MS 60000
+
+/* Renders a video as independent segments on several processes (or machines sharing the job directory),
+   then concatenates them. Command lines:
+	--drive <workers> <segments> <seconds> <output> <inputs...>
+		calibrates, writes the job to <output>.segments\job.yml, renders along with <workers> local
+		worker processes and concatenates the segments into <output>. 0 seconds renders the inputs through
+	--worker <job.yml>
+		renders the segments of a job no one has claimed yet, then exits
+   A segment is claimed by creating its .lock file, which only one process can do and which names
+   it (host:pid), and is done once its .done file exists */
+class SegmentDriver {
+private:
+	struct Segment {
+		int startFrame;
+		int seconds;
+		std::string output;
+	};
+	struct Job {
+		std::vector<std::string> inputs;
+		std::string calibration;
+		std::vector<Segment> segments;
+		bool save(const std::string &path) const;
+		bool load(const std::string &path);
+	};
+
+	static std::string quote(const std::string &s) {return "\"" + s + "\"";}
+	static bool isFileExist(const std::string &path);
+	static std::string lockFile(const Segment &seg) {return seg.output + ".lock";}
+	static std::string doneFile(const Segment &seg) {return seg.output + ".done";}
+	static std::string failedFile(const Segment &seg) {return seg.output + ".failed";}
+	static bool isFinished(const Segment &seg) {return isFileExist(doneFile(seg)) || isFileExist(failedFile(seg));}
+	/* host:pid written into the locks */
+	static std::string workerName(int pid);
+	static std::string lockOwner(const Segment &seg);
+
+	/* Calibration pass over the first seconds, false if nothing could be settled */
+	static bool calibrate(Job &job, const std::string &jobDir);
+	static bool renderSegment(const Job &job, const Segment &seg);
+	/* Segments in order into one video, re-encoded */
+	static bool concatenate(const Job &job, const std::string &output);
+
+	static int drive(const char *exe, int workers, int segmentCnt, int seconds,
+		const std::string &output, const std::vector<std::string> &inputs);
+	static int work(const std::string &jobFile);
+
+public:
+	/* Entry for the command lines above, -1 if they are not recognized */
+	static int main(int argc, char **argv);
+};
@@ -136,6 +136,10 @@ void LocalStitchingInfoGroup::push_back(int fidx, StitchingInfoGroup& g) {
 }
 
 StitchingInfoGroup LocalStitchingInfoGroup::getAver(int head, int tail, std::vector<int> &selectedFrameIdx, StitchingUtil &stitchingUtil) {
+	if (isSeededFlag) {
+		selectedFrameIdx = std::vector<int>(resultRoisUsedFrameCur.begin(), resultRoisUsedFrameCur.end());
+		return preSuccessSIG;
+	}
 	std::vector<std::pair<int,double>> tmp = groups.getBestIdx(head, tail);
 	int r = tmp.size()-1;
 	for (;r>=0 && tmp[r].second == 0;--r);
@@ -205,7 +209,7 @@ StitchingInfoGroup LocalStitchingInfoGroup::getAver(int head, int tail, std::vec
 
 void LocalStitchingInfoGroup::addToWaitingBuff(int fidx, std::vector<Mat>&v) {
 	std::vector<Mat> tmpV;
-	for (Mat m:v) tmpV.push_back(m.clone());
+	for (Mat m:v) tmpV.push_back(FramePool::copyOf(m));
 
 	if (stitchingWaitingBuff.size() >= LSIG_MAX_WAITING_BUFF_SIZE) {
 		stitchingWaitingBuffPersistedSize[fidx] = tmpV.size();
@@ -419,11 +423,15 @@ bool LocalStitchingInfoGroup::adjustPltForLSIG(StitchingInfoGroup &group, const
 }
 
 void LocalStitchingInfoGroup::addToStitchedBuff(int fidx, Mat& m) {
-	stitchedBuff.push_back(std::make_pair(fidx,m.clone()));
-	collectGarbage(fidx);
+	stitchedBuff.push_back(std::make_pair(fidx,FramePool::copyOf(m)));
 }
 
 void LocalStitchingInfoGroup::collectGarbage(int fidx) {
+	// No window when seeded, frames up to fidx are stitched and no longer needed
+	if (isSeededFlag) {
+		for (int del=fidx; removeFromWaitingBuff(del); --del);
+		return;
+	}
 	int del = groups.getRange().first-1;
 	bool ret;
 	do {
@@ -547,3 +555,158 @@ void StitchingInfo::getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs,
 		}
 	}
 }
+
+void StitchingInfo::write(FileStorage &fs) const {
+	fs << "{";
+	fs << "imgCnt" << imgCnt << "nonBlackRatio" << nonBlackRatio;
+	fs << "resizeSz" << resizeSz << "srcType" << srcType;
+	fs << "maskRatio" << Vec2d(maskRatio.first, maskRatio.second);
+	fs << "projData" << projData;
+	fs << "cameras" << "[";
+	for (int i=0; i<cameras.size(); ++i) {
+		fs << "{" << "focal" << cameras[i].focal << "aspect" << cameras[i].aspect
+			<< "ppx" << cameras[i].ppx << "ppy" << cameras[i].ppy
+			<< "R" << cameras[i].R << "t" << cameras[i].t << "}";
+	}
+	fs << "]";
+	fs << "ranges" << "[";
+	for (int i=0; i<ranges.size(); ++i) fs << Vec2i(ranges[i].start, ranges[i].end);
+	fs << "]";
+	fs << "resultRois" << "[";
+	for (int i=0; i<resultRois.size(); ++i)
+		fs << "{" << "srcSz" << resultRois[i].srcSz << "roi" << resultRois[i].roi << "imgIdx" << resultRois[i].imgIdx << "}";
+	fs << "]";
+	fs << "pltHelpers" << "[";
+	for (int i=0; i<pltHelpers.size(); ++i) fs << Vec4f(pltHelpers[i].ax, pltHelpers[i].bx, pltHelpers[i].ay, pltHelpers[i].by);
+	fs << "]";
+	fs << "}";
+}
+
+void StitchingInfo::read(const FileNode &node) {
+	clear();
+	node["imgCnt"] >> imgCnt;
+	node["nonBlackRatio"] >> nonBlackRatio;
+	node["resizeSz"] >> resizeSz;
+	node["srcType"] >> srcType;
+	Vec2d mr;
+	node["maskRatio"] >> mr;
+	maskRatio = std::make_pair(mr[0], mr[1]);
+	node["projData"] >> projData;
+	FileNode cams = node["cameras"];
+	for (FileNodeIterator it=cams.begin(); it!=cams.end(); ++it) {
+		cv::detail::CameraParams cam;
+		(*it)["focal"] >> cam.focal;
+		(*it)["aspect"] >> cam.aspect;
+		(*it)["ppx"] >> cam.ppx;
+		(*it)["ppy"] >> cam.ppy;
+		(*it)["R"] >> cam.R;
+		(*it)["t"] >> cam.t;
+		cameras.push_back(cam);
+	}
+	FileNode rgs = node["ranges"];
+	for (FileNodeIterator it=rgs.begin(); it!=rgs.end(); ++it) {
+		Vec2i r;
+		*it >> r;
+		ranges.push_back(Range(r[0], r[1]));
+	}
+	FileNode rois = node["resultRois"];
+	for (FileNodeIterator it=rois.begin(); it!=rois.end(); ++it) {
+		Size srcSz;
+		Rect roi;
+		int imgIdx;
+		(*it)["srcSz"] >> srcSz;
+		(*it)["roi"] >> roi;
+		(*it)["imgIdx"] >> imgIdx;
+		resultRois.push_back(supp::ResultRoi(srcSz, roi, imgIdx));
+	}
+	FileNode plts = node["pltHelpers"];
+	for (FileNodeIterator it=plts.begin(); it!=plts.end(); ++it) {
+		Vec4f p;
+		*it >> p;
+		pltHelpers.push_back(supp::PlaneLinearTransformHelper(p[0], p[1], p[2], p[3]));
+	}
+}
+
+void StitchingInfo::writeGroup(FileStorage &fs, const StitchingInfoGroup &group) {
+	fs << "[";
+	for (int i=0; i<group.size(); ++i) group[i].write(fs);
+	fs << "]";
+}
+
+void StitchingInfo::readGroup(const FileNode &node, StitchingInfoGroup &group) {
+	group.clear();
+	for (FileNodeIterator it=node.begin(); it!=node.end(); ++it) {
+		group.push_back(StitchingInfo());
+		group.back().read(*it);
+	}
+}
+
+bool LocalStitchingInfoGroup::writeCalibration(FileStorage &fs) const {
+	if (preSuccessSIG.empty()) return false;
+	fs << "preSuccessSIG";
+	StitchingInfo::writeGroup(fs, preSuccessSIG);
+	fs << "resultRoisBase" << "[";
+	for (int i=0; i<resultRoisBase.size(); ++i) {
+		fs << "[";
+		for (int j=0; j<resultRoisBase[i].size(); ++j)
+			fs << "{" << "srcSz" << resultRoisBase[i][j].srcSz << "roi" << resultRoisBase[i][j].roi
+				<< "imgIdx" << resultRoisBase[i][j].imgIdx << "}";
+		fs << "]";
+	}
+	fs << "]";
+	fs << "resultRoisUsedFrameBase" << std::vector<int>(resultRoisUsedFrameBase.begin(), resultRoisUsedFrameBase.end());
+	fs << "resultRoisUsedFrameCur" << std::vector<int>(resultRoisUsedFrameCur.begin(), resultRoisUsedFrameCur.end());
+	fs << "pltHelperGroup" << "[";
+	for (int i=0; i<pltHelperGroup.size(); ++i) {
+		fs << "[";
+		for (int j=0; j<pltHelperGroup[i].size(); ++j) {
+			const supp::PlaneLinearTransformHelper &p = pltHelperGroup[i][j];
+			fs << Vec4f(p.ax, p.bx, p.ay, p.by);
+		}
+		fs << "]";
+	}
+	fs << "]";
+	return true;
+}
+
+bool LocalStitchingInfoGroup::readCalibration(const FileNode &node) {
+	if (node.empty() || node["preSuccessSIG"].empty()) return false;
+	StitchingInfo::readGroup(node["preSuccessSIG"], preSuccessSIG);
+	if (!StitchingInfo::isSuccess(preSuccessSIG)) {
+		LOG_WARN("LSIG: calibration read is not a successful one, ignored.");
+		preSuccessSIG.clear();
+		return false;
+	}
+	resultRoisBase.clear();
+	FileNode bases = node["resultRoisBase"];
+	for (FileNodeIterator it=bases.begin(); it!=bases.end(); ++it) {
+		resultRoisBase.push_back(std::vector<supp::ResultRoi>());
+		for (FileNodeIterator jt=(*it).begin(); jt!=(*it).end(); ++jt) {
+			Size srcSz;
+			Rect roi;
+			int imgIdx;
+			(*jt)["srcSz"] >> srcSz;
+			(*jt)["roi"] >> roi;
+			(*jt)["imgIdx"] >> imgIdx;
+			resultRoisBase.back().push_back(supp::ResultRoi(srcSz, roi, imgIdx));
+		}
+	}
+	std::vector<int> v;
+	node["resultRoisUsedFrameBase"] >> v;
+	resultRoisUsedFrameBase = std::unordered_set<int>(v.begin(), v.end());
+	node["resultRoisUsedFrameCur"] >> v;
+	resultRoisUsedFrameCur = std::unordered_set<int>(v.begin(), v.end());
+	pltHelperGroup.clear();
+	FileNode plts = node["pltHelperGroup"];
+	for (FileNodeIterator it=plts.begin(); it!=plts.end(); ++it) {
+		pltHelperGroup.push_back(std::vector<supp::PlaneLinearTransformHelper>());
+		for (FileNodeIterator jt=(*it).begin(); jt!=(*it).end(); ++jt) {
+			Vec4f p;
+			*jt >> p;
+			pltHelperGroup.back().push_back(supp::PlaneLinearTransformHelper(p[0], p[1], p[2], p[3]));
+		}
+	}
+	isSeededFlag = true;
+	LOG_MESS("LSIG: seeded with a calibration, estimation is skipped.");
+	return true;
+}
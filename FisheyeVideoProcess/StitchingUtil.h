@@ -125,6 +125,12 @@ public:
 	static double evaluate(const StitchingInfoGroup &);
 	/* Calculate an average <class StitchingInfoGroup> */
 	static void getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs, StitchingInfoGroup &ret);
+
+	/* FileStorage (de)serialization of what stitching with a given info needs, features left out */
+	void write(FileStorage &fs) const;
+	void read(const FileNode &node);
+	static void writeGroup(FileStorage &fs, const StitchingInfoGroup &group);
+	static void readGroup(const FileNode &node, StitchingInfoGroup &group);
 };
 
 /* A window-size of <class StitchingInfoGroup> */
@@ -152,8 +158,11 @@ class LocalStitchingInfoGroup {
 	std::unordered_set<int> resultRoisUsedFrameCur;
 	std::vector<std::vector<supp::PlaneLinearTransformHelper>> pltHelperGroup;
 
+	/* Set by readCalibration(), every frame is then stitched with preSuccessSIG */
+	bool isSeededFlag;
+
 public:
-	LocalStitchingInfoGroup(int _wSize = LSIG_WINDOW_SIZE):wSize(_wSize){
+	LocalStitchingInfoGroup(int _wSize = LSIG_WINDOW_SIZE):wSize(_wSize),isSeededFlag(false){
 		groups = IntervalBestValueMaintainer<StitchingInfoGroup,double>(
 			int(LSIG_BEST_CAND_NUM),int(LSIG_WINDOW_SIZE),&StitchingInfo::evaluate);
 	}
@@ -187,6 +196,13 @@ public:
 	/* Set <class PlaneLinearTransformHelper> for <class LocalStitchingInfoGroup> */
 	bool adjustPltForLSIG(StitchingInfoGroup &, const std::vector<int>&, StitchingUtil &);
 
+	/* Stitching calibration settled so far (preSuccessSIG and the ROI/PLT state behind it),
+	   false if none is settled yet */
+	bool writeCalibration(FileStorage &fs) const;
+	/* Seed with a calibration, no estimation is done afterwards */
+	bool readCalibration(const FileNode &node);
+	bool isSeeded() const {return isSeededFlag;}
+
 };
 
 
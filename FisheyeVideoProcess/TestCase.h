@@ -1,6 +1,7 @@
 #pragma once
 #include "Config.h"		
 #include "StitchingUtil.h"
+#include "CorrectingUtil.h"
 #include "OtherUtils\ImageUtil.h"
 #include "Supplements\RewarpableWarper.h"
 #include "OtherUtils\FileUtil.h"
@@ -78,4 +79,64 @@ public:
 	}
 
 
+	/* Throughput of the correction gather, row-major against tiled */
+	void test7() {
+		const int lengths[] = {1440, 2880};
+		const int rounds = 20;
+		for (int li=0; li<2; ++li) {
+			int len = lengths[li];
+			Mat src(len, len, CV_8UC3), dst(len, len, CV_8UC3);
+			randu(src, Scalar::all(0), Scalar::all(255));
+			CorrectingParams cp(PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_REVERSED,
+				Point2i(len/2, len/2), len/2, LONG_LAT);
+			cp.interType = CORRECT_INTER_BILINEAR;
+			CorrectingUtil cu;
+			cu.setApplyMode(CORRECT_APPLY_TABLE);
+			cu.doCorrect(src, dst, cp);	// generate the table
+			for (int tiled=0; tiled<2; ++tiled) {
+				cu.setTiledGather(tiled != 0);
+				cu.doCorrect(src, dst, cp);	// warm up
+				int64 t0 = getTickCount();
+				for (int k=0; k<rounds; ++k) cu.doCorrect(src, dst, cp);
+				double ms = (getTickCount()-t0)*1000.0/getTickFrequency()/rounds;
+				std::cout << len << "x" << len << (tiled ? " tiled: " : " row-major: ")
+					<< ms << " ms/frame, " << len*(double)len/ms/1000 << " Mpix/s" << std::endl;
+			}
+		}
+	}
+
+	/* Table lookup against computing on the fly, per input length and core count */
+	void test8() {
+		const int lengths[] = {1440, 2880};
+		const int rounds = 20;
+		int cores = getNumberOfCPUs();
+		for (int li=0; li<2; ++li) {
+			int len = lengths[li];
+			Mat src(len, len, CV_8UC3), dst(len, len, CV_8UC3);
+			randu(src, Scalar::all(0), Scalar::all(255));
+			CorrectingParams cp(PERSPECTIVE_LONG_LAT_MAPPING_CAM_LENS_MOD_REVERSED,
+				Point2i(len/2, len/2), len/2, LONG_LAT);
+			cp.interType = CORRECT_INTER_BILINEAR;
+			CorrectingUtil cu;
+			cu.setApplyMode(CORRECT_APPLY_TABLE);
+			cu.doCorrect(src, dst, cp);	// generate the table
+			for (int threads=1; ; threads=min(threads*2, cores)) {
+				setNumThreads(threads);
+				double ms[2];
+				for (int compute=0; compute<2; ++compute) {
+					cu.setApplyMode(compute ? CORRECT_APPLY_COMPUTE : CORRECT_APPLY_TABLE);
+					cu.doCorrect(src, dst, cp);	// warm up
+					int64 t0 = getTickCount();
+					for (int k=0; k<rounds; ++k) cu.doCorrect(src, dst, cp);
+					ms[compute] = (getTickCount()-t0)*1000.0/getTickFrequency()/rounds;
+				}
+				std::cout << len << "x" << len << ", " << threads << " threads: table " << ms[0]
+					<< " ms/frame, computing " << ms[1] << " ms/frame, "
+					<< (ms[1] < ms[0] ? "computing" : "table") << " wins" << std::endl;
+				if (threads == cores) break;
+			}
+			setNumThreads(-1);
+		}
+	}
+
 };